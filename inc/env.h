@@ -39,6 +39,11 @@ enum {
 	ENV_NOT_RUNNABLE
 };
 
+// Working-set windows: env_wss[i] counts the pages accessed during the
+// last WSS_WINDOW(i) scans of kern/wss.c, i.e. 1, 4 and 16 scans.
+#define WSS_NWINDOWS		3
+#define WSS_WINDOW(i)		(1 << (2 * (i)))
+
 // Special environment types
 enum EnvType {
 	ENV_TYPE_USER = 0,
@@ -58,6 +63,31 @@ struct Env {
 	// or root of extended page tables in guest mode.
 	physaddr_t env_cr3;
 	uint8_t *elf;
+
+	uint64_t env_colors;		// Page colours this env may use (bit c = colour c)
+	uint16_t env_pcid;		// TLB tag, valid while env_pcid_gen is current
+	uint64_t env_pcid_gen;
+
+	// Last page table found by user_mem_check, covering the 2MB at
+	// env_ptc_va; valid while env_ptc_gen == page_table_gen.
+	pte_t *env_ptc_pt;
+	uintptr_t env_ptc_va;
+	uint64_t env_ptc_gen;
+
+	// Lab 4 IPC
+	bool env_ipc_recving;		// Env is blocked receiving
+	void *env_ipc_dstva;		// VA at which to map received page
+	uint32_t env_ipc_value;		// Data value sent to us
+	envid_t env_ipc_from;		// envid of the sender
+	int env_ipc_perm;		// Perm of page mapping received
+
+	struct VmRegion *env_regions;	// Zero-fill-on-demand ranges
+
+	// Working-set estimates, in 4KB pages, as of the last scan.
+	// Read-only to the env itself through envs[] at UENVS.
+	uint32_t env_rss;		// Pages mapped
+	uint32_t env_wss[WSS_NWINDOWS];	// Pages recently accessed
+	uint64_t env_wss_scans;		// Scans seen by this env
 };
 
 #endif // !JOS_INC_ENV_H
@@ -14,6 +14,9 @@ enum {
 				// the maximum allowed
 	E_FAULT		= 6,	// Memory fault
 	E_NO_SYS	= 7,	// Unimplemented system call
+	E_IPC_NOT_RECV	= 8,	// Attempt to send to env that is not recving
+	E_NO_DISK	= 9,	// No disk to keep pages on
+	E_IO		= 10,	// Disk I/O error
 	// VMM error codes.
 	E_NO_VMX = 17,    // The processor doesn't support VMX or 
 	// is turned off in the BIOS
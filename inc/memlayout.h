@@ -126,6 +126,11 @@
 // Top of user-accessible VM
 #define UTOP		UENVS
 
+// An env has page tables of its own only under PML4 entry 0.  The rest
+// of the entry holding UTOP maps the same kernel page tables in every
+// env, so user pages can only be mapped below UVA_END.
+#define UVA_END		0x8000000000
+
 // Top of one-page user exception stack
 #define UXSTACKTOP	0xef800000
 // Next page left invalid to guard against exception stack overflow; then:
@@ -174,6 +179,14 @@ extern volatile pde_t uvpml4e[];     // VA of current page map level 4
 
 LIST_HEAD(Page_list,Page);
 typedef LIST_ENTRY(Page) Page_LIST_entry_t;
+// Width of the page numbers in struct PageInfo links.  pages[] must fit
+// in the UPAGES window anyway, which is far fewer than 2^24 entries.
+#define PP_LINK_BITS	24
+#define PP_LINK_MAX	(1 << PP_LINK_BITS)
+// Most references a page may have.  pp_ref is 16 bits, so taking more
+// must fail rather than wrap (the zero page, never freed, excepted).
+#define PP_REF_MAX	0xFFFF
+
 /*
  * Page descriptor structures, mapped at UPAGES.
  * Read/write to the kernel, read-only to user programs.
@@ -183,18 +196,46 @@ typedef LIST_ENTRY(Page) Page_LIST_entry_t;
  * correspondence between physical pages and struct PageInfo's.
  * You can map a struct PageInfo * to the corresponding physical address
  * with page2pa() in kern/pmap.h.
+ *
+ * The structure is packed into 8 bytes to keep pages[] (and the UPAGES
+ * window it is mapped in) small.  Free-list links are page numbers rather
+ * than pointers; 0 means "none", since page 0 is never allocated.  A page
+ * on the buddy lists always has a zero reference count, so the back link
+ * shares its storage with pp_ref.  Use page_next()/page_prev() in
+ * kern/pmap.h to follow the links.
  */
 struct PageInfo {
-	// Next page on the free list.
-	struct PageInfo *pp_link;
-	
-	// pp_ref is the count of pointers (usually in page table entries)
-	// to this page, for pages allocated using page_alloc.
-	// Pages allocated at boot time using pmap.c's
-	// boot_alloc do not have valid reference count fields.
-	
-	uint16_t pp_ref;
+	// Next block on the buddy free list.  Only the first page of a
+	// free block is linked; 0 for pages in use.
+	uint32_t pp_link : PP_LINK_BITS;
+	uint32_t pp_flags : 8;
+
+	union {
+		struct {
+			// Previous block on the buddy free list, while
+			// PP_FREE is set.
+			uint32_t pp_prev : PP_LINK_BITS;
+
+			// log2 of the block size in pages, valid while
+			// PP_FREE, PP_SLAB or PP_KMALLOC is set.
+			uint32_t pp_order : 8;
+		};
+
+		// pp_ref is the count of pointers (usually in page table
+		// entries) to this page, for pages allocated using
+		// page_alloc.  Pages allocated at boot time using pmap.c's
+		// boot_alloc do not have valid reference count fields.
+		uint16_t pp_ref;
+	};
 };
 
+// Values of pp_flags
+#define PP_FREE		0x01	// First page of a free buddy block
+#define PP_CACHED	0x02	// Free, parked in a per-CPU page magazine
+#define PP_ZEROED	0x04	// Free and zero-filled, parked in the zero pool
+#define PP_SLAB		0x08	// Part of a kmem_cache slab
+#define PP_KMALLOC	0x10	// First page of a large kmalloc block
+#define PP_COLORED	0x20	// Free, parked in a page colour bin
+
 #endif /* !__ASSEMBLER__ */
 #endif /* !JOS_INC_MEMLAYOUT_H */
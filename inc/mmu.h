@@ -76,20 +76,34 @@
 #define PTE_A		0x020	// Accessed
 #define PTE_D		0x040	// Dirty
 #define PTE_PS		0x080	// Page Size
+#define PTE_G		0x100	// Global (kept in the TLB across CR3 loads)
 #define PTE_MBZ		0x180	// Bits must be zero
 
-// The PTE_AVAIL bits aren't used by the kernel or interpreted by the
-// hardware, so user processes are allowed to set them arbitrarily.
+// The PTE_AVAIL bits aren't interpreted by the hardware.  User
+// processes may set them arbitrarily, except for the ones in
+// PTE_KERN_AVAIL, which the kernel keeps for itself.
 #define PTE_AVAIL	0xE00	// Available for software use
+#define PTE_COW		0x800	// Copy-on-write: shared until written
+#define PTE_KSM		0x400	// Merged with identical pages (kern/ksm.c)
+#define PTE_DISK	0x800	// Not present: the page is on disk (kern/diskmap.c)
+#define PTE_KERN_AVAIL	(PTE_COW | PTE_KSM)
 
 // Flags in PTE_SYSCALL may be used only in system calls. (Others may not.)
-#define PTE_SYSCALL (PTE_AVAIL | PTE_P | PTE_W | PTE_U)
+#define PTE_SYSCALL ((PTE_AVAIL & ~PTE_KERN_AVAIL) | PTE_P | PTE_W | PTE_U)
 
 // Only flags in PTE_USER may be used in system calls.
-#define PTE_USER	(PTE_AVAIL | PTE_P | PTE_W | PTE_U)
+#define PTE_USER	((PTE_AVAIL & ~PTE_KERN_AVAIL) | PTE_P | PTE_W | PTE_U)
+
+// Bits 52-57 are ignored by the hardware too.  The kernel keeps there
+// the number of working-set scans since the page was last accessed
+// (kern/wss.c), saturating at PTE_AGE_MAX.
+#define PTE_AGE_SHIFT	52
+#define PTE_AGE_MAX	0x3F
+#define PTE_AGE_MASK	((uint64_t) PTE_AGE_MAX << PTE_AGE_SHIFT)
+#define PTE_AGE(pte)	(((pte) >> PTE_AGE_SHIFT) & PTE_AGE_MAX)
 
 // Address in page table or page directory entry
-#define PTE_ADDR(pte)	((physaddr_t) (pte) & ~0xFFF)
+#define PTE_ADDR(pte)	((physaddr_t) (pte) & 0x000FFFFFFFFFF000ULL)
 
 // Control Register flags
 #define CR0_PE		0x00000001	// Protection Enable
@@ -105,6 +119,7 @@
 #define CR0_PG		0x80000000	// Paging
 
 #define CR4_PCE		0x00000100	// Performance counter enable
+#define CR4_PGE		0x00000080	// Page Global Enable
 #define CR4_MCE		0x00000040	// Machine Check Enable
 #define CR4_PSE		0x00000010	// Page Size Extensions
 #define CR4_DE		0x00000008	// Debugging Extensions
@@ -112,6 +127,11 @@
 #define CR4_PVI		0x00000002	// Protected-Mode Virtual Interrupts
 #define CR4_VME		0x00000001	// V86 Mode Extensions
 #define CR4_VMXE	0x00002000	// VMX 
+#define CR4_PCIDE	0x00020000	// Process-context identifiers
+
+// CR3 bits when CR4_PCIDE is set
+#define CR3_PCID_MASK	0x0000000000000FFFULL	// PCID of the address space
+#define CR3_NOFLUSH	0x8000000000000000ULL	// Keep the PCID's TLB entries
 
 // x86_64 related flags
 #define CR4_PAE		0x00000020
@@ -7,6 +7,19 @@ enum {
 	SYS_cgetc,
 	SYS_getenvid,
 	SYS_env_destroy,
+	SYS_page_alloc,
+	SYS_page_map,
+	SYS_page_unmap,
+	SYS_exofork,
+	SYS_env_set_status,
+	SYS_yield,
+	SYS_ipc_try_send,
+	SYS_ipc_recv,
+	SYS_fork,
+	SYS_region_reserve,
+	SYS_env_dirty_log,
+	SYS_env_checkpoint,
+	SYS_env_restore,
 	NSYSCALLS
 };
 
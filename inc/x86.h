@@ -31,12 +31,15 @@ static __inline uint64_t rcr3(void) __attribute__((always_inline));
 static __inline void lcr4(uint64_t val) __attribute__((always_inline));
 static __inline uint64_t rcr4(void) __attribute__((always_inline));
 static __inline void tlbflush(void) __attribute__((always_inline));
+static __inline void sfence(void) __attribute__((always_inline));
 static __inline uint64_t read_eflags(void) __attribute__((always_inline));
 static __inline void write_eflags(uint64_t eflags) __attribute__((always_inline));
 static __inline uint64_t read_rbp(void) __attribute__((always_inline));
 static __inline uint64_t read_rsp(void) __attribute__((always_inline));
 static __inline void cpuid(uint32_t info, uint32_t *eaxp, uint32_t *ebxp, uint32_t *ecxp, uint32_t *edxp);
+static __inline void cpuid_count(uint32_t info, uint32_t subleaf, uint32_t *eaxp, uint32_t *ebxp, uint32_t *ecxp, uint32_t *edxp);
 static __inline uint64_t read_tsc(void) __attribute__((always_inline));
+static __inline uint64_t bsf(uint64_t v) __attribute__((always_inline));
 static __inline uint64_t read_msr(uint32_t ecx) __attribute__((always_inline));
 static __inline void write_msr( uint32_t ecx, uint64_t val ) __attribute__((always_inline));
 static __inline void read_idtr (uint64_t *idtbase, uint16_t *idtlimit) __attribute__((always_inline));
@@ -231,6 +234,12 @@ tlbflush(void)
 	__asm __volatile("movq %0,%%cr3" : : "r" (cr3));
 }
 
+static __inline void
+sfence(void)
+{
+	__asm __volatile("sfence" : : : "memory");
+}
+
 static __inline uint64_t
 read_eflags(void)
 {
@@ -304,6 +313,24 @@ cpuid(uint32_t info, uint32_t *eaxp, uint32_t *ebxp, uint32_t *ecxp, uint32_t *e
 		*edxp = edx;
 }
 
+// cpuid for leaves that take a subleaf index in ecx.
+static __inline void
+cpuid_count(uint32_t info, uint32_t subleaf, uint32_t *eaxp, uint32_t *ebxp, uint32_t *ecxp, uint32_t *edxp)
+{
+	uint32_t eax, ebx, ecx, edx;
+	asm volatile("cpuid" 
+			 : "=a" (eax), "=b" (ebx), "=c" (ecx), "=d" (edx)
+			 : "a" (info), "c" (subleaf));
+	if (eaxp)
+		*eaxp = eax;
+	if (ebxp)
+		*ebxp = ebx;
+	if (ecxp)
+		*ecxp = ecx;
+	if (edxp)
+		*edxp = edx;
+}
+
 static inline uint32_t
 xchg(volatile uint32_t *addr,uint32_t newval){
 	uint32_t result;
@@ -317,9 +344,18 @@ xchg(volatile uint32_t *addr,uint32_t newval){
 static __inline uint64_t
 read_tsc(void)
 {
-	uint64_t tsc;
-	__asm __volatile("rdtsc" : "=A" (tsc));
-	return tsc;
+	uint32_t lo, hi;
+	__asm __volatile("rdtsc" : "=a" (lo), "=d" (hi));
+	return ((uint64_t) hi << 32) | lo;
+}
+
+// Index of the lowest set bit of 'v', which must not be 0.
+static __inline uint64_t
+bsf(uint64_t v)
+{
+	uint64_t index;
+	__asm __volatile("bsfq %1,%0" : "=r" (index) : "rm" (v));
+	return index;
 }
 
 static __inline uint64_t
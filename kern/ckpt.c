@@ -0,0 +1,321 @@
+/* See COPYRIGHT for copyright information. */
+
+// Saving an env to disk, and restoring it later.
+//
+// An image holds the env's registers, its zero-fill-on-demand regions
+// and every page mapped in its user address space, with the
+// permissions it was mapped with.  A slot is laid out as
+//
+//	page 0			struct CkptHeader
+//	pages 1..CKPT_INDEX	one entry per saved page: va | flags
+//	the rest		the saved pages, in index order
+//
+// Restoring builds the env's page tables with every saved page left on
+// disk (see kern/diskmap.c), so that a restored env only reads back the
+// pages it goes on to use.  Pages of zeroes are not written at all.
+
+#include <inc/mmu.h>
+#include <inc/error.h>
+#include <inc/string.h>
+#include <inc/assert.h>
+
+#include <kern/env.h>
+#include <kern/pmap.h>
+#include <kern/kmalloc.h>
+#include <kern/region.h>
+#include <kern/ide.h>
+#include <kern/diskmap.h>
+#include <kern/ckpt.h>
+
+#define CKPT_MAGIC	0x4a4f53434b505431ULL	// "JOSCKPT1"
+#define CKPT_INDEX	4			// Index pages
+#define CKPT_DATA	(1 + CKPT_INDEX)	// First data page
+#define CKPT_MAXPAGES	(CKPT_SLOT_NPAGES - CKPT_DATA)
+#define CKPT_MAXREGIONS	64
+
+// In an index entry: the page was mapped to the zero page.
+#define CKPT_ZERO	PTE_DISK
+
+struct CkptHeader {
+	uint64_t ch_magic;
+	uint32_t ch_npages;		// Index entries used
+	uint32_t ch_nregions;
+	uint64_t ch_colors;
+	envid_t ch_owner;		// Env that saved the image; 0: the monitor
+	struct Trapframe ch_tf;
+	struct {
+		uintptr_t start;
+		uintptr_t end;
+		int perm;
+	} ch_regions[CKPT_MAXREGIONS];
+};
+
+// Saving state.
+struct CkptSave {
+	uint32_t cs_base;		// First disk page of the slot
+	uint32_t cs_npages;
+	uint64_t *cs_index;
+	void *cs_bounce;		// For pages that are on disk already
+};
+
+static int
+ckpt_save_page(struct CkptSave *s, uintptr_t va, pte_t pte, const void *data)
+{
+	uint64_t entry;
+	int r;
+
+	if (s->cs_npages == CKPT_MAXPAGES)
+		return -E_NO_MEM;
+	// Copy-on-write pages come back private and writable.
+	entry = va | (pte & PTE_SYSCALL & ~PTE_P);
+	if (pte & PTE_COW)
+		entry |= PTE_W;
+	if (data == page2kva(zero_page))
+		entry |= CKPT_ZERO;
+	else if ((r = diskmap_write(s->cs_base + CKPT_DATA + s->cs_npages, data)) < 0)
+		return r;
+	s->cs_index[s->cs_npages++] = entry;
+	return 0;
+}
+
+static int
+ckpt_save_table(struct CkptSave *s, physaddr_t pa, int level, uintptr_t va)
+{
+	uint64_t *t = KADDR(pa);
+	uintptr_t size = (uintptr_t) PGSIZE << (9 * (level - 1));
+	int i, j, r;
+
+	for (i = 0; i < NPTENTRIES; i++, va += size) {
+		if (level == 1 && PTE_ON_DISK(t[i])) {
+			if ((r = diskmap_read(PTE_DISKPAGE(t[i]), s->cs_bounce)) < 0 ||
+			    (r = ckpt_save_page(s, va, t[i], s->cs_bounce)) < 0)
+				return r;
+			continue;
+		}
+		if (!(t[i] & PTE_P))
+			continue;
+		if (level == 1)
+			r = ckpt_save_page(s, va, t[i], KADDR(PTE_ADDR(t[i])));
+		else if (level == 2 && (t[i] & PTE_PS))
+			for (j = 0, r = 0; j < NPTENTRIES && r == 0; j++)
+				r = ckpt_save_page(s, va + j * PGSIZE, t[i],
+						   KADDR(PTE_ADDR(t[i]) + j * PGSIZE));
+		else
+			r = ckpt_save_table(s, PTE_ADDR(t[i]), level - 1, va);
+		if (r < 0)
+			return r;
+	}
+	return 0;
+}
+
+//
+// Returns 0 if env 'id', or the monitor if 'id' is 0, may restore or
+// replace the image with header h: if it saved the image, or has
+// envid2env rights over the env that did.  envid2env takes 0 to mean
+// curenv, so an image the monitor saved is the monitor's alone.
+//
+static int
+ckpt_check_owner(struct CkptHeader *h, envid_t id)
+{
+	struct Env *owner;
+
+	if (!id || h->ch_owner == id)
+		return 0;
+	if (!h->ch_owner || envid2env(h->ch_owner, &owner, 1) < 0)
+		return -E_BAD_ENV;
+	return 0;
+}
+
+//
+// Save env e to checkpoint slot 'slot', replacing what was there.
+// 'owner' is the env doing the saving, or 0 for the monitor; only it
+// and its parent may restore or replace the image.  If 'in_syscall', e is saving
+// itself through sys_env_checkpoint, and the copy restored later sees
+// that call return 1.
+//
+// RETURNS:
+//   0 on success
+//   -E_INVAL, if there is no such slot, or an env restored from the
+//	slot still has pages to read from it
+//   -E_BAD_ENV, if the slot holds an image 'owner' may not replace
+//   -E_NO_MEM, if e has too many pages or regions for a slot, or
+//	there is no memory to work in
+//   -E_NO_DISK, -E_IO on disk trouble
+//
+int
+ckpt_save(struct Env *e, int slot, envid_t owner, bool in_syscall)
+{
+	struct CkptSave s;
+	struct CkptHeader *h;
+	struct VmRegion *vr;
+	uint32_t i, base = slot * CKPT_SLOT_NPAGES;
+	int r;
+
+	static_assert(sizeof(struct CkptHeader) <= PGSIZE);
+	static_assert(CKPT_MAXPAGES * sizeof(uint64_t) <= CKPT_INDEX * PGSIZE);
+
+	if (!ide_present)
+		return -E_NO_DISK;
+	if (slot < 0 || slot >= CKPT_NSLOTS || diskmap_busy(base, CKPT_SLOT_NPAGES))
+		return -E_INVAL;
+
+	s.cs_base = base;
+	s.cs_npages = 0;
+	s.cs_index = kmalloc(CKPT_INDEX * PGSIZE, 0);
+	s.cs_bounce = kmalloc(PGSIZE, 0);
+	h = kmalloc(PGSIZE, 0);
+	r = -E_NO_MEM;
+	if (!s.cs_index || !s.cs_bounce || !h)
+		goto out;
+
+	if ((r = diskmap_read(base, h)) < 0)
+		goto out;
+	if (h->ch_magic == CKPT_MAGIC && (r = ckpt_check_owner(h, owner)) < 0)
+		goto out;
+	// Until the new header is written, the slot holds no image.
+	memset(h, 0, PGSIZE);
+	if ((r = diskmap_write(base, h)) < 0)
+		goto out;
+	if ((e->env_pml4e[0] & PTE_P) &&
+	    (r = ckpt_save_table(&s, PTE_ADDR(e->env_pml4e[0]), 3, 0)) < 0)
+		goto out;
+	for (i = 0; i < ROUNDUP(s.cs_npages, PGSIZE / 8) / (PGSIZE / 8); i++)
+		if ((r = diskmap_write(base + 1 + i, (char *) s.cs_index + i * PGSIZE)) < 0)
+			goto out;
+
+	r = -E_NO_MEM;
+	for (vr = e->env_regions; vr; vr = vr->vr_next) {
+		if (h->ch_nregions == CKPT_MAXREGIONS)
+			goto out;
+		h->ch_regions[h->ch_nregions].start = vr->vr_start;
+		h->ch_regions[h->ch_nregions].end = vr->vr_end;
+		h->ch_regions[h->ch_nregions].perm = vr->vr_perm;
+		h->ch_nregions++;
+	}
+	h->ch_magic = CKPT_MAGIC;
+	h->ch_npages = s.cs_npages;
+	h->ch_colors = e->env_colors;
+	h->ch_owner = owner;
+	h->ch_tf = e->env_tf;
+	if (in_syscall)
+		h->ch_tf.tf_regs.reg_rax = 1;
+	r = diskmap_write(base, h);
+out:
+	if (s.cs_index)
+		kfree(s.cs_index);
+	if (s.cs_bounce)
+		kfree(s.cs_bounce);
+	if (h)
+		kfree(h);
+	return r;
+}
+
+static int
+ckpt_load(struct Env *e, uint32_t base, struct CkptHeader *h, uint64_t *index)
+{
+	uintptr_t va;
+	pte_t *pte;
+	uint32_t i;
+	int perm, r;
+
+	for (i = 0; i < h->ch_npages; i++) {
+		va = PTE_ADDR(index[i]);
+		perm = index[i] & PTE_SYSCALL;
+		if (va >= UVA_END)
+			return -E_INVAL;
+		if (index[i] & CKPT_ZERO) {
+			// Shared until written, as in a fresh region.
+			if (perm & PTE_W)
+				perm = (perm & ~PTE_W) | PTE_COW;
+			r = page_insert(e->env_pml4e, zero_page, (void *) va, perm | PTE_P);
+			if (r < 0)
+				return r;
+			continue;
+		}
+		if (!(pte = pml4e_walk(e->env_pml4e, (void *) va, 1)))
+			return -E_NO_MEM;
+		if (*pte)
+			return -E_INVAL;
+		// Dirty until first harvested, like any new mapping.
+		diskmap_set(pte, base + CKPT_DATA + i, perm | PTE_D);
+	}
+	for (i = 0; i < h->ch_nregions; i++)
+		if ((r = region_reserve(e, h->ch_regions[i].start,
+					h->ch_regions[i].end - h->ch_regions[i].start,
+					h->ch_regions[i].perm)) < 0)
+			return r;
+	return 0;
+}
+
+//
+// Create a new env, a child of 'parent_id', from the image in 'slot'.
+// Its pages stay on disk until it touches them.  On success the new
+// env is runnable and stored in *newenv_store.
+//
+// A parent_id other than 0 (the monitor) must be curenv, and must be
+// the image's owner or have the rights envid2env grants over it.
+//
+// RETURNS:
+//   0 on success
+//   -E_INVAL, if there is no such slot, or no valid image in it
+//   -E_BAD_ENV, if parent_id may not restore the image
+//   -E_NO_FREE_ENV, -E_NO_MEM, if out of envs or memory
+//   -E_NO_DISK, -E_IO on disk trouble
+//
+int
+ckpt_restore(int slot, envid_t parent_id, struct Env **newenv_store)
+{
+	struct CkptHeader *h;
+	struct Trapframe tf;
+	struct Env *e = NULL;
+	uint64_t *index;
+	uint32_t i, base = slot * CKPT_SLOT_NPAGES;
+	int r;
+
+	if (!ide_present)
+		return -E_NO_DISK;
+	if (slot < 0 || slot >= CKPT_NSLOTS)
+		return -E_INVAL;
+
+	h = kmalloc(PGSIZE, 0);
+	index = kmalloc(CKPT_INDEX * PGSIZE, 0);
+	r = -E_NO_MEM;
+	if (!h || !index)
+		goto out;
+	if ((r = diskmap_read(base, h)) < 0)
+		goto out;
+	r = -E_INVAL;
+	if (h->ch_magic != CKPT_MAGIC || h->ch_npages > CKPT_MAXPAGES ||
+	    h->ch_nregions > CKPT_MAXREGIONS)
+		goto out;
+	if ((r = ckpt_check_owner(h, parent_id)) < 0)
+		goto out;
+	for (i = 0; i < ROUNDUP(h->ch_npages, PGSIZE / 8) / (PGSIZE / 8); i++)
+		if ((r = diskmap_read(base + 1 + i, (char *) index + i * PGSIZE)) < 0)
+			goto out;
+
+	if ((r = env_alloc(&e, parent_id)) < 0)
+		goto out;
+	if ((r = ckpt_load(e, base, h, index)) < 0) {
+		env_free(e);
+		goto out;
+	}
+	// Registers as saved, in the user segments.
+	tf = h->ch_tf;
+	tf.tf_ds = e->env_tf.tf_ds;
+	tf.tf_es = e->env_tf.tf_es;
+	tf.tf_ss = e->env_tf.tf_ss;
+	tf.tf_cs = e->env_tf.tf_cs;
+	e->env_tf = tf;
+	// The image may come from a machine with more colours.
+	e->env_colors = (h->ch_colors & page_color_valid()) ? h->ch_colors :
+		PAGE_COLOR_ALL;
+	*newenv_store = e;
+	r = 0;
+out:
+	if (h)
+		kfree(h);
+	if (index)
+		kfree(index);
+	return r;
+}
@@ -0,0 +1,19 @@
+/* See COPYRIGHT for copyright information. */
+
+#ifndef JOS_KERN_CKPT_H
+#define JOS_KERN_CKPT_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/env.h>
+
+// Checkpoint images take the first CKPT_NSLOTS * CKPT_SLOT_NPAGES pages
+// of the second disk, one image per slot.
+#define CKPT_NSLOTS		4
+#define CKPT_SLOT_NPAGES	2048		// 8MB
+
+int	ckpt_save(struct Env *e, int slot, envid_t owner, bool in_syscall);
+int	ckpt_restore(int slot, envid_t parent_id, struct Env **newenv_store);
+
+#endif /* !JOS_KERN_CKPT_H */
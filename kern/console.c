@@ -7,6 +7,9 @@
 #include <inc/assert.h>
 
 #include <kern/console.h>
+#include <kern/pmap.h>
+#include <kern/ksm.h>
+#include <kern/wss.h>
 
 static void cons_intr(int (*proc)(void));
 static void cons_putc(int c);
@@ -458,8 +461,14 @@ getchar(void)
 {
 	int c;
 
-	while ((c = cons_getc()) == 0)
-		/* do nothing */;
+	// Waiting for a keystroke is the kernel's idle loop; let the page
+	// allocator, the page merger and the working-set scanner do their
+	// background work meanwhile.
+	while ((c = cons_getc()) == 0) {
+		page_idle();
+		ksm_idle();
+		wss_tick();
+	}
 	return c;
 }
 
@@ -0,0 +1,20 @@
+#ifndef JOS_KERN_CPU_H
+#define JOS_KERN_CPU_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/types.h>
+
+// Maximum number of CPUs
+#define NCPU	8
+
+// Returns the index of the CPU we are running on.  Only the bootstrap
+// processor is brought up so far, so this is always CPU 0.
+static inline int
+cpunum(void)
+{
+	return 0;
+}
+
+#endif
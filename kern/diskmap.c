@@ -0,0 +1,144 @@
+/* See COPYRIGHT for copyright information. */
+
+// User pages that live on the second disk until they are touched:
+// pages of restored checkpoints (kern/ckpt.c) and swapped-out pages
+// (kern/swap.c).
+//
+// Such a page is mapped by a non-present PTE that names its disk page
+// (see PTE_ON_DISK).  The first access faults, and diskmap_fault reads
+// the page into a fresh physical page and maps that instead.  A disk
+// page may be named by several PTEs, after fork; diskmap_ref counts
+// them, so that the disk page is not reused while it is still needed.
+
+#include <inc/mmu.h>
+#include <inc/error.h>
+#include <inc/assert.h>
+
+#include <kern/env.h>
+#include <kern/pmap.h>
+#include <kern/ide.h>
+#include <kern/diskmap.h>
+
+static uint16_t diskmap_ref[DISK_NPAGES];
+
+int
+diskmap_read(uint32_t dpage, void *dst)
+{
+	assert(dpage < DISK_NPAGES);
+	return ide_read(dpage * BLKSECTS, dst, BLKSECTS);
+}
+
+int
+diskmap_write(uint32_t dpage, const void *src)
+{
+	assert(dpage < DISK_NPAGES);
+	return ide_write(dpage * BLKSECTS, src, BLKSECTS);
+}
+
+//
+// Make the PTE *pte, which maps nothing, stand for disk page 'dpage',
+// to be mapped with 'perm' once faulted in.  PTE_D in 'perm' is kept
+// for page_dirty_log.
+//
+void
+diskmap_set(pte_t *pte, uint32_t dpage, int perm)
+{
+	assert(dpage < DISK_NPAGES && !(*pte & PTE_P));
+	diskmap_ref[dpage]++;
+	*pte = ((pte_t) dpage << PGSHIFT) | (perm & (PTE_SYSCALL | PTE_D) & ~PTE_P) | PTE_DISK;
+}
+
+// A copy of the on-disk PTE 'pte' was made.
+void
+diskmap_dup(pte_t pte)
+{
+	diskmap_ref[PTE_DISKPAGE(pte)]++;
+}
+
+// Clear the on-disk PTE *pte.
+void
+diskmap_drop(pte_t *pte)
+{
+	diskmap_ref[PTE_DISKPAGE(*pte)]--;
+	*pte = 0;
+}
+
+//
+// Returns true if any of the 'npages' disk pages from 'dpage' is still
+// named by a PTE.
+//
+bool
+diskmap_busy(uint32_t dpage, uint32_t npages)
+{
+	uint32_t i;
+
+	for (i = dpage; i < dpage + npages; i++)
+		if (diskmap_ref[i])
+			return 1;
+	return 0;
+}
+
+//
+// Find a disk page among the 'npages' from 'dpage' that no PTE names,
+// looking on from where the last search stopped.  Returns it, or
+// -E_NO_MEM if there is none.
+//
+int
+diskmap_alloc(uint32_t dpage, uint32_t npages)
+{
+	static uint32_t next;
+	uint32_t i, n;
+
+	for (i = 0; i < npages; i++) {
+		n = (next + i) % npages;
+		if (!diskmap_ref[dpage + n]) {
+			next = n + 1;
+			return dpage + n;
+		}
+	}
+	return -E_NO_MEM;
+}
+
+// Returns how many of the 'npages' disk pages from 'dpage' are in use.
+uint32_t
+diskmap_count(uint32_t dpage, uint32_t npages)
+{
+	uint32_t i, n = 0;
+
+	for (i = dpage; i < dpage + npages; i++)
+		if (diskmap_ref[i])
+			n++;
+	return n;
+}
+
+//
+// Bring in the page at 'va' in env e, if it is on disk.
+//
+// RETURNS:
+//   0 on success
+//   -E_FAULT, if the page at 'va' is not on disk
+//   -E_NO_MEM, if there is no page to read it into
+//   -E_IO, if the disk fails
+//
+int
+diskmap_fault(struct Env *e, uintptr_t va)
+{
+	struct PageInfo *pp;
+	pte_t *pte;
+	int perm, r;
+
+	va = ROUNDDOWN(va, PGSIZE);
+	if (!(pte = pml4e_walk(e->env_pml4e, (void *) va, 0)) ||
+	    !PTE_ON_DISK(*pte))
+		return -E_FAULT;
+	if (!(pp = page_alloc_color(e->env_colors, 0)))
+		return -E_NO_MEM;
+	if ((r = diskmap_read(PTE_DISKPAGE(*pte), page2kva(pp))) < 0) {
+		page_free(pp);
+		return r;
+	}
+	perm = *pte & PTE_SYSCALL;
+	diskmap_drop(pte);
+	// The page table is there already, so this can't fail.
+	return page_insert(e->env_pml4e, pp, (void *) va, perm);
+}
@@ -0,0 +1,32 @@
+/* See COPYRIGHT for copyright information. */
+
+#ifndef JOS_KERN_DISKMAP_H
+#define JOS_KERN_DISKMAP_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/types.h>
+#include <inc/mmu.h>
+
+struct Env;
+
+// A non-present user PTE with PTE_DISK set stands for a page whose
+// contents are in page PTE_DISKPAGE(pte) of the second disk.  Its low
+// bits hold the permissions the page gets when it is faulted back in,
+// and PTE_D if it was written since page_dirty_log last looked at it.
+#define PTE_ON_DISK(pte)	(((pte) & (PTE_P | PTE_DISK)) == PTE_DISK)
+#define PTE_DISKPAGE(pte)	((uint32_t) (PTE_ADDR(pte) >> PGSHIFT))
+
+int	diskmap_read(uint32_t dpage, void *dst);
+int	diskmap_write(uint32_t dpage, const void *src);
+
+void	diskmap_set(pte_t *pte, uint32_t dpage, int perm);
+void	diskmap_dup(pte_t pte);
+void	diskmap_drop(pte_t *pte);
+bool	diskmap_busy(uint32_t dpage, uint32_t npages);
+int	diskmap_alloc(uint32_t dpage, uint32_t npages);
+uint32_t diskmap_count(uint32_t dpage, uint32_t npages);
+int	diskmap_fault(struct Env *e, uintptr_t va);
+
+#endif /* !JOS_KERN_DISKMAP_H */
@@ -11,6 +11,9 @@
 #include <kern/pmap.h>
 #include <kern/trap.h>
 #include <kern/monitor.h>
+#include <kern/sched.h>
+#include <kern/region.h>
+#include <kern/diskmap.h>
 #include <kern/macro.h>
 #include <kern/dwarf_api.h>
 
@@ -187,6 +190,9 @@ env_setup_vm(struct Env *e)
 
 	p->pp_ref++;
 	e->env_pml4e = page2kva(p);
+	e->env_cr3 = page2pa(p);
+	e->env_pcid_gen = 0;
+	e->env_ptc_pt = NULL;
 	*(e->env_pml4e + PML4(UTOP)) = *(boot_pml4e + PML4(UTOP)); 
 	
 	// Now, set e->env_pml4e and initialize the page directory.
@@ -249,6 +255,11 @@ env_alloc(struct Env **newenv_store, envid_t parent_id)
 	e->env_type = ENV_TYPE_USER;
 	e->env_status = ENV_RUNNABLE;
 	e->env_runs = 0;
+	e->env_colors = PAGE_COLOR_ALL;
+	e->env_regions = NULL;
+	e->env_rss = 0;
+	memset(e->env_wss, 0, sizeof(e->env_wss));
+	e->env_wss_scans = 0;
 
 	// Clear out all the saved register state,
 	// to prevent the register values
@@ -286,35 +297,58 @@ env_alloc(struct Env **newenv_store, envid_t parent_id)
 // Pages should be writable by user and kernel.
 // Panic if any allocation attempt fails.
 //
+// 'va' and 'len' need not be page-aligned: va is rounded down and
+// va + len rounded up.  The pages are allocated and mapped a page table
+// (2MB) at a time with page_alloc_bulk_color and page_map_range, from
+// the env's page colours.  Whole, aligned 2MB spans get a single 2MB
+// page instead when the env isn't restricted to some colours (a 2MB
+// block has pages of every colour) and a free block is available.
+//
 static void
 region_alloc(struct Env *e, void *va, size_t len)
 {
-	// LAB 3: Your code here.
-	// (But only if you need it for load_icode.)
-
-	//Need to add panic behavior
-	int status;
+	struct PageInfo *batch[NPTENTRIES];
+	uint64_t start = (uint64_t) ROUNDDOWN(va, PGSIZE);
+	uint64_t end = (uint64_t) ROUNDUP((uint64_t) va + len, PGSIZE);
 	uint64_t i;
-	
-	uint64_t roundedLen = (uint64_t) ROUNDUP(len,PGSIZE);
-
-	uint64_t roundedVa = (uint64_t) ROUNDDOWN(va,PGSIZE);
+	size_t n;
 
-	for (i = roundedVa; i < roundedVa + roundedLen; i+= PGSIZE) {
-		struct PageInfo * currPage = page_alloc(0);
-//	the pp_ref will be increased by the page_insert() function
-//		currPage->pp_ref++;
-		status = page_insert(e->env_pml4e, currPage, (void *)i, PTE_U| PTE_W);
-		if (status < 0)
+	for (i = start; i < end; i += n * PGSIZE) {
+		n = MIN((size_t) (NPTENTRIES - PTX(i)), (size_t) ((end - i) / PGSIZE));
+		if (n == NPTENTRIES && e->env_colors == PAGE_COLOR_ALL &&
+		    page_map_huge(e->env_pml4e, (void *) i, PTE_U | PTE_W, 0) == 0)
+			continue;
+		if (page_alloc_bulk_color(n, e->env_colors, 0, batch) < 0)
+			panic("region_alloc: out of memory");
+		if (page_map_range(e->env_pml4e, (void *) i, batch, n, PTE_U | PTE_W) < 0)
 			panic("page insertion failed!\n");
-		
 	}
-	
-	
-	// Hint: It is easier to use region_alloc if the caller can pass
-	//   'va' and 'len' values that are not page-aligned.
-	//   You should round va down, and round (va + len) up.
-	//   (Watch out for corner-cases!)
+}
+
+//
+// Take write access away from the pages lying wholly inside
+// [start, end) of env e's address space, which must be loaded.
+// Returns -E_NO_MEM if a 2MB page in the way can't be split.
+//
+static int
+region_readonly(struct Env *e, uintptr_t start, uintptr_t end)
+{
+	uintptr_t va;
+	pte_t *pte;
+	int r = 0;
+
+	start = ROUNDUP(start, PGSIZE);
+	end = ROUNDDOWN(end, PGSIZE);
+	if (start >= end)
+		return 0;
+	for (va = start; va < end; va += PGSIZE) {
+		if ((r = pml4e_walk_split(e->env_pml4e, (void *) va, 0, &pte)) < 0)
+			break;
+		if (pte)
+			*pte &= ~PTE_W;
+	}
+	tlb_invalidate_range(e->env_pml4e, (void *) start, end - start);
+	return r;
 }
 
 //
@@ -384,44 +418,51 @@ load_icode(struct Env *e, uint8_t *binary)
 
 
 	struct Elf * theElf = (struct Elf *) binary;
-	int i, status;
 
 	if (theElf->e_magic!= ELF_MAGIC)
 		cprintf("\n\n\n Can't load Elf !!! \n\n\n)");
 
 	struct Proghdr * ph = (struct Proghdr *)((uint8_t *) theElf + theElf->e_phoff);
 	struct Proghdr * eph = ph +theElf->e_phnum;
+	uintptr_t bss;
 
 	// change the root page table to env's pml4e, so as to load data	
-	lcr3(PADDR(e->env_pml4e));
+	tlb_switch(e);
 	for (; ph < eph; ph++) {
 		if ( ph->p_type == ELF_PROG_LOAD) {
-			region_alloc(e, (void *) ph->p_va, ph->p_memsz);
-			// address to load into
-			uint8_t * cursor = (uint8_t *) ph->p_va;
-
-			// address to load from
-			uint8_t * index = binary + ph->p_offset;
-			
-			// the actual size is ph->p_filesz
-			for (i = 0; i < ph->p_memsz; i++) {
-				if (i < ph->p_filesz)
-					*(cursor+i) = *(index +i);	
-				else
-					*(cursor+i) = 0;
-			}
+			// Pages holding file data are allocated now.  The
+			// rest of the bss is left to zero-fill on demand, and
+			// reads of it share the zero page.
+			bss = ROUNDUP(ph->p_va + ph->p_filesz, PGSIZE);
+			bss = MIN(bss, ph->p_va + ph->p_memsz);
+			region_alloc(e, (void *) ph->p_va, bss - ph->p_va);
+
+			// copy the file image, then clear the rest (bss)
+			memcpy((void *) ph->p_va, binary + ph->p_offset, ph->p_filesz);
+			memset((void *) (ph->p_va + ph->p_filesz), 0,
+			       bss - (ph->p_va + ph->p_filesz));
+
+			if (bss < ph->p_va + ph->p_memsz &&
+			    region_reserve(e, bss, ph->p_va + ph->p_memsz - bss,
+					   (ph->p_flags & ELF_PROG_FLAG_WRITE) ?
+					   PTE_U | PTE_W : PTE_U) < 0)
+				panic("load_icode: out of memory");
 		}
 	}
 
+	// Text and read-only data don't need to be writable, which lets
+	// fork share them outright instead of copy-on-write.  Pages shared
+	// with a writable segment stay writable.
+	for (ph = (struct Proghdr *) (binary + theElf->e_phoff); ph < eph; ph++)
+		if (ph->p_type == ELF_PROG_LOAD && !(ph->p_flags & ELF_PROG_FLAG_WRITE))
+			if (region_readonly(e, ph->p_va, ph->p_va + ph->p_memsz) < 0)
+				panic("load_icode: out of memory");
+
 	// set rip register in Trapframe to the entry point
 	e->env_tf.tf_rip = theElf->e_entry;  
 
 	// map stack
-	struct PageInfo *stack_page = page_alloc(0);
-	status = page_insert(e->env_pml4e, 
-		stack_page, (void *)(USTACKTOP - PGSIZE), PTE_U| PTE_W);
-	if (status < 0)
-		panic("page insertion failed!\n");
+	region_alloc(e, (void *) (USTACKTOP - PGSIZE), PGSIZE);
 	
 	lcr3(boot_cr3);
 }
@@ -451,17 +492,66 @@ env_create(uint8_t *binary, enum EnvType type)
 	
 }
 
+// Pages whose last reference env_free dropped, handed back to the
+// allocator together.
+static struct PageInfo *env_free_batch[NPTENTRIES];
+static size_t env_free_nbatch;
+
+static void
+env_free_put(struct PageInfo *pp)
+{
+	if (pp == zero_page || --pp->pp_ref > 0)
+		return;
+	env_free_batch[env_free_nbatch++] = pp;
+	if (env_free_nbatch == NPTENTRIES) {
+		page_free_bulk(env_free_batch, env_free_nbatch);
+		env_free_nbatch = 0;
+	}
+}
+
+//
+// Release every page reachable from the page-table page at 'pa', which
+// is a PDPT (level 3), page directory (2) or page table (1), and then
+// the page-table page itself.  The tables are being thrown away, so
+// their entries are left as they are.
+//
+static void
+env_free_table(physaddr_t pa, int level)
+{
+	uint64_t *t = KADDR(pa);
+	int i, j;
+
+	for (i = 0; i < NPTENTRIES; i++) {
+		if (level == 1 && PTE_ON_DISK(t[i]))
+			diskmap_drop(&t[i]);
+		if (!(t[i] & PTE_P))
+			continue;
+		if (level == 1)
+			env_free_put(pa2page(PTE_ADDR(t[i])));
+		else if (level == 2 && (t[i] & PTE_PS))
+			// A 2MB page: each of its pages holds a reference.
+			for (j = 0; j < NPTENTRIES; j++)
+				env_free_put(pa2page(PTE_ADDR(t[i]) + j * PGSIZE));
+		else
+			env_free_table(PTE_ADDR(t[i]), level - 1);
+	}
+	if (level == 1)
+		page_table_gen++;
+	env_free_put(pa2page(pa));
+}
+
 //
 // Frees env e and all memory it uses.
 //
+// The user half (PML4 entry 0) is torn down in one bottom-up pass over
+// the page tables.  The address space is never loaded again and its
+// PCID is retired, so no TLB entries need to be invalidated page by page.
+//
 void
 env_free(struct Env *e)
 {
-	pte_t *pt;
-	uint64_t pdeno, pteno;
 	physaddr_t pa;
 
-
 	// If freeing the current environment, switch to kern_pgdir
 	// before freeing the page directory, just in case the page
 	// gets reused.
@@ -471,51 +561,22 @@ env_free(struct Env *e)
 	// Note the environment's demise.
 	cprintf("[%08x] free env %08x\n", curenv ? curenv->env_id : 0, e->env_id);
 
-	// Flush all mapped pages in the user portion of the address space
-	pdpe_t *env_pdpe = KADDR(PTE_ADDR(e->env_pml4e[0]));
-	int pdeno_limit;
-	uint64_t pdpe_index;
-	// using 3 instead of NPDPENTRIES as we have only first three indices
-	// set for 4GB of address space.
-	for(pdpe_index=0;pdpe_index<=3;pdpe_index++){
-		if(!(env_pdpe[pdpe_index] & PTE_P))
-			continue;
-		pde_t *env_pgdir = KADDR(PTE_ADDR(env_pdpe[pdpe_index]));
-		pdeno_limit  = pdpe_index==3?PDX(UTOP):PDX(0xFFFFFFFF);
-		static_assert(UTOP % PTSIZE == 0);
-		for (pdeno = 0; pdeno < pdeno_limit; pdeno++) {
-
-			// only look at mapped page tables
-			if (!(env_pgdir[pdeno] & PTE_P))
-				continue;
-			// find the pa and va of the page table
-			pa = PTE_ADDR(env_pgdir[pdeno]);
-			pt = (pte_t*) KADDR(pa);
-
-			// unmap all PTEs in this page table
-			for (pteno = 0; pteno < PTX(~0); pteno++) {
-				if (pt[pteno] & PTE_P){
-					page_remove(e->env_pml4e, PGADDR((uint64_t)0,pdpe_index,pdeno, pteno, 0));
-				}
-			}
-
-			// free the page table itself
-			env_pgdir[pdeno] = 0;
-			page_decref(pa2page(pa));
-		}
-		// free the page directory
-		pa = PTE_ADDR(env_pdpe[pdpe_index]);
-		env_pdpe[pdpe_index] = 0;
-		page_decref(pa2page(pa));
-	}
-	// free the page directory pointer
-	page_decref(pa2page(PTE_ADDR(e->env_pml4e[0])));
-	// free the page map level 4 (PML4)
+	// Free all mapped pages and page tables in the user portion of
+	// the address space
+	if (e->env_pml4e[0] & PTE_P)
+		env_free_table(PTE_ADDR(e->env_pml4e[0]), 3);
 	e->env_pml4e[0] = 0;
+	region_free_all(e);
+
+	// free the page map level 4 (PML4)
 	pa = e->env_cr3;
 	e->env_pml4e = 0;
 	e->env_cr3 = 0;
-	page_decref(pa2page(pa));
+	// Its PCID may still tag TLB entries; never load it again.
+	e->env_pcid_gen = 0;
+	env_free_put(pa2page(pa));
+	page_free_bulk(env_free_batch, env_free_nbatch);
+	env_free_nbatch = 0;
 
 	// return the environment to the free list
 	e->env_status = ENV_FREE;
@@ -529,11 +590,12 @@ env_free(struct Env *e)
 void
 env_destroy(struct Env *e)
 {
-
 	env_free(e);
-	cprintf("Destroyed the only environment - nothing more to do!\n");
-	while (1)
-		monitor(NULL);
+
+	if (curenv == e) {
+		curenv = NULL;
+		sched_yield();
+	}
 }
 
 
@@ -594,7 +656,7 @@ env_run(struct Env *e)
 
 	// LAB 3: Your code here.
 
-	if (curenv) 
+	if (curenv && curenv->env_status == ENV_RUNNING)
 		curenv->env_status = ENV_RUNNABLE;
 	
 	curenv = e;
@@ -603,7 +665,7 @@ env_run(struct Env *e)
 
 	curenv->env_runs++;
 
-	lcr3((uint64_t)PADDR( (uint64_t)e->env_pml4e));
+	tlb_switch(e);
 
 	struct Trapframe * tf = &(curenv->env_tf);
 	
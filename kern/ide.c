@@ -0,0 +1,102 @@
+/* See COPYRIGHT for copyright information. */
+
+// Minimal PIO-based (non-interrupt-driven) IDE driver for the second
+// disk on the primary channel.
+
+#include <inc/x86.h>
+#include <inc/mmu.h>
+#include <inc/stdio.h>
+#include <inc/error.h>
+#include <inc/assert.h>
+
+#include <kern/ide.h>
+
+#define IDE_BSY		0x80
+#define IDE_DRDY	0x40
+#define IDE_DF		0x20
+#define IDE_ERR		0x01
+
+bool ide_present;
+
+static int
+ide_wait_ready(bool check_error)
+{
+	int r;
+
+	while (((r = inb(0x1F7)) & (IDE_BSY|IDE_DRDY)) != IDE_DRDY)
+		/* do nothing */;
+
+	if (check_error && (r & (IDE_DF|IDE_ERR)) != 0)
+		return -1;
+	return 0;
+}
+
+//
+// Select disk 1 and check that it answers.
+//
+void
+ide_init(void)
+{
+	int r, x;
+
+	// wait for Device 0 to be ready
+	ide_wait_ready(0);
+
+	// switch to Device 1
+	outb(0x1F6, 0xE0 | (1<<4));
+
+	// check for Device 1 to be ready for a while.  A missing drive
+	// reads back as 0 (or all ones), never as just DRDY.
+	for (x = 0;
+	     x < 1000 && ((r = inb(0x1F7)) & (IDE_BSY|IDE_DRDY|IDE_DF|IDE_ERR)) != IDE_DRDY;
+	     x++)
+		/* do nothing */;
+
+	ide_present = (x < 1000);
+	cprintf("IDE disk 1: %s\n", ide_present ? "present" : "absent");
+}
+
+static void
+ide_start(uint32_t secno, size_t nsecs, int cmd)
+{
+	assert(nsecs <= 256);
+
+	ide_wait_ready(0);
+
+	outb(0x1F2, nsecs);
+	outb(0x1F3, secno & 0xFF);
+	outb(0x1F4, (secno >> 8) & 0xFF);
+	outb(0x1F5, (secno >> 16) & 0xFF);
+	outb(0x1F6, 0xE0 | (1<<4) | ((secno>>24)&0x0F));
+	outb(0x1F7, cmd);
+}
+
+int
+ide_read(uint32_t secno, void *dst, size_t nsecs)
+{
+	if (!ide_present)
+		return -E_NO_DISK;
+	ide_start(secno, nsecs, 0x20);	// CMD 0x20 means read sector
+
+	for (; nsecs > 0; nsecs--, dst += SECTSIZE) {
+		if (ide_wait_ready(1) < 0)
+			return -E_IO;
+		insl(0x1F0, dst, SECTSIZE/4);
+	}
+	return 0;
+}
+
+int
+ide_write(uint32_t secno, const void *src, size_t nsecs)
+{
+	if (!ide_present)
+		return -E_NO_DISK;
+	ide_start(secno, nsecs, 0x30);	// CMD 0x30 means write sector
+
+	for (; nsecs > 0; nsecs--, src += SECTSIZE) {
+		if (ide_wait_ready(1) < 0)
+			return -E_IO;
+		outsl(0x1F0, src, SECTSIZE/4);
+	}
+	return 0;
+}
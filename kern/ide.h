@@ -0,0 +1,24 @@
+/* See COPYRIGHT for copyright information. */
+
+#ifndef JOS_KERN_IDE_H
+#define JOS_KERN_IDE_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/types.h>
+
+#define SECTSIZE	512			// Bytes per disk sector
+#define BLKSECTS	(PGSIZE / SECTSIZE)	// Sectors per page
+
+// The second IDE disk (QEMU's -hdb, obj/kern/disk.img) holds user pages
+// that are not in memory: checkpoint images and swap.
+#define DISK_NPAGES	16384			// 64MB
+
+extern bool ide_present;
+
+void	ide_init(void);
+int	ide_read(uint32_t secno, void *dst, size_t nsecs);
+int	ide_write(uint32_t secno, const void *src, size_t nsecs);
+
+#endif /* !JOS_KERN_IDE_H */
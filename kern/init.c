@@ -4,17 +4,21 @@
 #include <inc/string.h>
 #include <inc/assert.h>
 #include <inc/memlayout.h>
+#include <inc/x86.h>
 
 #include <kern/monitor.h>
 #include <kern/console.h>
 #include <kern/kdebug.h>
 #include <kern/dwarf_api.h>
 #include <kern/pmap.h>
+#include <kern/kmalloc.h>
 #include <kern/kclock.h>
 #include <kern/env.h>
 #include <kern/trap.h>
+#include <kern/ide.h>
 
 uint64_t end_debug;
+uint64_t boot_cycles;		// From entry to the first env, for kerninfo
 
 
 
@@ -25,6 +29,7 @@ i386_init(void)
 	/* __asm __volatile("int $12"); */
 
 	extern char edata[], end[];
+	uint64_t boot_tsc = read_tsc();
 
 	// Before doing anything else, complete the ELF loading process.
 	// Clear the uninitialized global data (BSS) section of our program.
@@ -42,10 +47,12 @@ i386_init(void)
 
 	// Lab 2 memory management initialization functions
 	x64_vm_init();
+	kmem_init();
 
 	// Lab 3 user environment initialization functions
 	env_init();
 	trap_init();
+	ide_init();
 
 
 
@@ -58,6 +65,9 @@ i386_init(void)
 	ENV_CREATE(user_evilhello, ENV_TYPE_USER);
 #endif // TEST*
 
+	// Recorded here rather than at entry: the memset above clears it.
+	boot_cycles = read_tsc() - boot_tsc;
+
 	// We only have one user environment for now, so just run it.
 	env_run(&envs[0]);
 }
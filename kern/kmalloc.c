@@ -0,0 +1,567 @@
+/* See COPYRIGHT for copyright information. */
+
+// Slab allocator for kernel objects smaller than a page.
+//
+// A kmem_cache hands out objects of one size.  Objects are carved out of
+// slabs: naturally aligned blocks of 2^kc_order pages obtained from
+// page_alloc_order, with a struct kmem_slab header at the start of the
+// block.  Every page of a slab is marked PP_SLAB and records the slab's
+// order, so the slab (and thus the cache) owning any object can be found
+// from the object's address alone.
+//
+// Each cache keeps a small per-CPU array of free objects in front of its
+// slabs, like the page magazines in pmap.c.  Allocation and free only
+// touch the local array; the slabs are visited a batch at a time.
+//
+// A cache may have a constructor.  It runs once, when a slab is created,
+// and objects are expected to be handed back to kmem_cache_free in their
+// constructed state.  The free-list link of such a cache is kept after
+// the object so that it does not overwrite constructed fields.
+
+#include <inc/assert.h>
+#include <inc/error.h>
+#include <inc/stdio.h>
+#include <inc/string.h>
+
+#include <kern/pmap.h>
+#include <kern/cpu.h>
+#include <kern/kmalloc.h>
+
+#define KMEM_NAME_LEN	24
+#define KMEM_CPU_MAX	32	// Free objects held per CPU
+#define KMEM_CPU_BATCH	16	// Objects moved between a CPU and the slabs
+#define KMEM_MIN_OBJS	8	// Grow the slab order until this many fit
+#define KMEM_MAX_ORDER	3	// ...but never beyond 8 pages
+#define KMEM_EMPTY_MAX	1	// Empty slabs kept around per cache
+
+struct kmem_slab {
+	struct kmem_cache *sl_cache;
+	struct kmem_slab *sl_next;	// On kc_partial, kc_full or kc_empty
+	struct kmem_slab *sl_prev;
+	void *sl_free;			// Free objects, linked at kc_link
+	int sl_inuse;			// Objects not on sl_free
+};
+
+struct kmem_cpu_cache {
+	void *kcc_objs[KMEM_CPU_MAX];
+	int kcc_count;
+};
+
+struct kmem_cache {
+	char kc_name[KMEM_NAME_LEN];
+	size_t kc_size;			// Object size asked for
+	size_t kc_stride;		// Distance between objects in a slab
+	size_t kc_link;			// Offset of the free-list link
+	size_t kc_offset;		// Offset of the first object in a slab
+	int kc_order;			// Slabs are PGSIZE << kc_order bytes
+	int kc_perslab;			// Objects per slab
+	void (*kc_ctor)(void *obj);
+
+	// Slabs by state.  A slab is on exactly one of these lists.
+	struct kmem_slab *kc_partial;
+	struct kmem_slab *kc_full;
+	struct kmem_slab *kc_empty;
+	int kc_nempty;
+
+	struct kmem_cpu_cache kc_cpu[NCPU];
+	struct kmem_cache *kc_next;	// On kmem_caches
+
+	// Statistics
+	uint64_t kc_allocs;
+	uint64_t kc_cpu_hits;		// Allocations served by the CPU array
+	uint64_t kc_frees;
+	uint64_t kc_fails;
+	uint64_t kc_slab_creates;
+	uint64_t kc_slab_destroys;
+	size_t kc_nslabs;
+	size_t kc_inuse;		// Objects handed out and not yet freed
+};
+
+#define KMEM_LINK(cp, obj)	(*(void **) ((char *) (obj) + (cp)->kc_link))
+
+// The cache that struct kmem_caches are allocated from.
+static struct kmem_cache kmem_cache_cache;
+// All caches, for kmem_print_stats.
+static struct kmem_cache *kmem_caches;
+// kmalloc size classes, indexed by log2(size) - KMALLOC_MIN_SHIFT.
+static struct kmem_cache *kmalloc_caches[KMALLOC_MAX_SHIFT - KMALLOC_MIN_SHIFT + 1];
+
+static void check_kmem(void);
+
+
+// --------------------------------------------------------------
+// Slabs
+// --------------------------------------------------------------
+
+static void
+kmem_slab_list_add(struct kmem_slab **head, struct kmem_slab *sl)
+{
+	sl->sl_prev = NULL;
+	sl->sl_next = *head;
+	if (*head)
+		(*head)->sl_prev = sl;
+	*head = sl;
+}
+
+static void
+kmem_slab_list_del(struct kmem_slab **head, struct kmem_slab *sl)
+{
+	if (sl->sl_prev)
+		sl->sl_prev->sl_next = sl->sl_next;
+	else
+		*head = sl->sl_next;
+	if (sl->sl_next)
+		sl->sl_next->sl_prev = sl->sl_prev;
+	sl->sl_next = sl->sl_prev = NULL;
+}
+
+//
+// Allocate a slab for 'cp', construct its objects and put it on
+// cp->kc_empty.  Returns NULL if out of memory.
+//
+static struct kmem_slab *
+kmem_slab_create(struct kmem_cache *cp)
+{
+	struct PageInfo *pp;
+	struct kmem_slab *sl;
+	char *obj;
+	int i;
+
+	if (!(pp = page_alloc_order(cp->kc_order, 0)))
+		return NULL;
+	for (i = 0; i < (1 << cp->kc_order); i++) {
+		pp[i].pp_flags |= PP_SLAB;
+		pp[i].pp_order = cp->kc_order;
+	}
+
+	sl = (struct kmem_slab *) page2kva(pp);
+	sl->sl_cache = cp;
+	sl->sl_free = NULL;
+	sl->sl_inuse = 0;
+	// Link the objects in address order.
+	obj = (char *) sl + cp->kc_offset + (cp->kc_perslab - 1) * cp->kc_stride;
+	for (i = 0; i < cp->kc_perslab; i++, obj -= cp->kc_stride) {
+		if (cp->kc_ctor)
+			cp->kc_ctor(obj);
+		KMEM_LINK(cp, obj) = sl->sl_free;
+		sl->sl_free = obj;
+	}
+
+	kmem_slab_list_add(&cp->kc_empty, sl);
+	cp->kc_nempty++;
+	cp->kc_nslabs++;
+	cp->kc_slab_creates++;
+	return sl;
+}
+
+//
+// Give an empty slab's pages back to the page allocator.
+//
+static void
+kmem_slab_destroy(struct kmem_cache *cp, struct kmem_slab *sl)
+{
+	struct PageInfo *pp = pa2page(PADDR(sl));
+	int i;
+
+	assert(sl->sl_inuse == 0);
+	kmem_slab_list_del(&cp->kc_empty, sl);
+	cp->kc_nempty--;
+	cp->kc_nslabs--;
+	cp->kc_slab_destroys++;
+
+	for (i = 0; i < (1 << cp->kc_order); i++)
+		pp[i].pp_flags &= ~PP_SLAB;
+	page_free_order(pp, cp->kc_order);
+}
+
+//
+// Return the slab that 'obj' was allocated from.
+// Panics if 'obj' does not point into a slab.
+//
+static struct kmem_slab *
+kmem_obj_slab(void *obj)
+{
+	struct PageInfo *pp = pa2page(PADDR(obj));
+
+	if (!(pp->pp_flags & PP_SLAB))
+		panic("kmem: %p is not a slab object", obj);
+	return (struct kmem_slab *) ROUNDDOWN((uintptr_t) obj, PGSIZE << pp->pp_order);
+}
+
+
+// --------------------------------------------------------------
+// Per-CPU object arrays
+// --------------------------------------------------------------
+
+//
+// Move up to KMEM_CPU_BATCH objects from the slabs of 'cp' into 'cc',
+// creating a slab if there are no free objects.
+//
+static void
+kmem_cpu_refill(struct kmem_cache *cp, struct kmem_cpu_cache *cc)
+{
+	struct kmem_slab *sl;
+	void *obj;
+
+	while (cc->kcc_count < KMEM_CPU_BATCH) {
+		if (!(sl = cp->kc_partial)) {
+			if (!(sl = cp->kc_empty) && !(sl = kmem_slab_create(cp)))
+				return;
+			kmem_slab_list_del(&cp->kc_empty, sl);
+			cp->kc_nempty--;
+			kmem_slab_list_add(&cp->kc_partial, sl);
+		}
+		while (cc->kcc_count < KMEM_CPU_BATCH && (obj = sl->sl_free)) {
+			sl->sl_free = KMEM_LINK(cp, obj);
+			sl->sl_inuse++;
+			cc->kcc_objs[cc->kcc_count++] = obj;
+		}
+		if (!sl->sl_free) {
+			kmem_slab_list_del(&cp->kc_partial, sl);
+			kmem_slab_list_add(&cp->kc_full, sl);
+		}
+	}
+}
+
+//
+// Return the oldest objects in 'cc' to their slabs until only 'keep'
+// are left.  Slabs that become empty beyond KMEM_EMPTY_MAX are released.
+//
+static void
+kmem_cpu_flush(struct kmem_cache *cp, struct kmem_cpu_cache *cc, int keep)
+{
+	struct kmem_slab *sl;
+	void *obj;
+	int i, n;
+
+	if (cc->kcc_count <= keep)
+		return;
+	n = cc->kcc_count - keep;
+	for (i = 0; i < n; i++) {
+		obj = cc->kcc_objs[i];
+		sl = kmem_obj_slab(obj);
+		if (!sl->sl_free) {
+			kmem_slab_list_del(&cp->kc_full, sl);
+			kmem_slab_list_add(&cp->kc_partial, sl);
+		}
+		KMEM_LINK(cp, obj) = sl->sl_free;
+		sl->sl_free = obj;
+		if (--sl->sl_inuse == 0) {
+			kmem_slab_list_del(&cp->kc_partial, sl);
+			kmem_slab_list_add(&cp->kc_empty, sl);
+			cp->kc_nempty++;
+		}
+	}
+	memmove(cc->kcc_objs, cc->kcc_objs + n, keep * sizeof(void *));
+	cc->kcc_count = keep;
+
+	while (cp->kc_nempty > KMEM_EMPTY_MAX)
+		kmem_slab_destroy(cp, cp->kc_empty);
+}
+
+
+// --------------------------------------------------------------
+// Caches
+// --------------------------------------------------------------
+
+static int
+kmem_cache_setup(struct kmem_cache *cp, const char *name, size_t size,
+		 size_t align, void (*ctor)(void *obj))
+{
+	size_t slabsize;
+
+	if (align == 0)
+		align = sizeof(void *);
+	if (size == 0 || (align & (align - 1)) || align > PGSIZE)
+		return -E_INVAL;
+	align = MAX(align, sizeof(void *));
+
+	memset(cp, 0, sizeof(*cp));
+	strncpy(cp->kc_name, name, KMEM_NAME_LEN - 1);
+	cp->kc_size = size;
+	cp->kc_ctor = ctor;
+	// Objects with a constructor keep their link after the object.
+	cp->kc_link = ctor ? ROUNDUP(size, sizeof(void *)) : 0;
+	cp->kc_stride = ROUNDUP(MAX(size, cp->kc_link + sizeof(void *)), align);
+	cp->kc_offset = ROUNDUP(sizeof(struct kmem_slab), align);
+
+	for (cp->kc_order = 0; ; cp->kc_order++) {
+		slabsize = PGSIZE << cp->kc_order;
+		if (slabsize < cp->kc_offset)
+			cp->kc_perslab = 0;
+		else
+			cp->kc_perslab = (slabsize - cp->kc_offset) / cp->kc_stride;
+		if (cp->kc_perslab >= KMEM_MIN_OBJS || cp->kc_order == KMEM_MAX_ORDER)
+			break;
+	}
+	if (cp->kc_perslab == 0)
+		return -E_INVAL;
+
+	cp->kc_next = kmem_caches;
+	kmem_caches = cp;
+	return 0;
+}
+
+//
+// Create a cache of objects of 'size' bytes aligned to 'align' (0 for
+// pointer alignment).  'ctor', if not NULL, is run on each object when
+// its slab is created.
+// Returns NULL if out of memory or if the object cannot fit in a slab.
+//
+struct kmem_cache *
+kmem_cache_create(const char *name, size_t size, size_t align,
+		  void (*ctor)(void *obj))
+{
+	struct kmem_cache *cp;
+
+	if (!(cp = kmem_cache_alloc(&kmem_cache_cache)))
+		return NULL;
+	if (kmem_cache_setup(cp, name, size, align, ctor) < 0) {
+		kmem_cache_free(&kmem_cache_cache, cp);
+		return NULL;
+	}
+	return cp;
+}
+
+//
+// Destroy a cache made with kmem_cache_create.
+// Every object must have been freed.
+//
+void
+kmem_cache_destroy(struct kmem_cache *cp)
+{
+	struct kmem_cache **cpp;
+	int i;
+
+	for (i = 0; i < NCPU; i++)
+		kmem_cpu_flush(cp, &cp->kc_cpu[i], 0);
+	if (cp->kc_partial || cp->kc_full)
+		panic("kmem_cache_destroy: %s still has objects in use", cp->kc_name);
+	while (cp->kc_empty)
+		kmem_slab_destroy(cp, cp->kc_empty);
+
+	for (cpp = &kmem_caches; *cpp != cp; cpp = &(*cpp)->kc_next)
+		assert(*cpp);
+	*cpp = cp->kc_next;
+	kmem_cache_free(&kmem_cache_cache, cp);
+}
+
+//
+// Allocate an object from 'cp'.  Returns NULL if out of memory.
+//
+void *
+kmem_cache_alloc(struct kmem_cache *cp)
+{
+	struct kmem_cpu_cache *cc = &cp->kc_cpu[cpunum()];
+
+	if (cc->kcc_count > 0)
+		cp->kc_cpu_hits++;
+	else {
+		kmem_cpu_refill(cp, cc);
+		if (cc->kcc_count == 0) {
+			cp->kc_fails++;
+			return NULL;
+		}
+	}
+	cp->kc_allocs++;
+	cp->kc_inuse++;
+	return cc->kcc_objs[--cc->kcc_count];
+}
+
+//
+// Return 'obj' to 'cp'.
+//
+void
+kmem_cache_free(struct kmem_cache *cp, void *obj)
+{
+	struct kmem_cpu_cache *cc = &cp->kc_cpu[cpunum()];
+
+	if (kmem_obj_slab(obj)->sl_cache != cp)
+		panic("kmem_cache_free: %p does not belong to %s", obj, cp->kc_name);
+	if (cc->kcc_count == KMEM_CPU_MAX)
+		kmem_cpu_flush(cp, cc, KMEM_CPU_MAX - KMEM_CPU_BATCH);
+	cc->kcc_objs[cc->kcc_count++] = obj;
+	cp->kc_frees++;
+	cp->kc_inuse--;
+}
+
+
+// --------------------------------------------------------------
+// kmalloc
+// --------------------------------------------------------------
+
+//
+// Allocate 'size' bytes of kernel memory.  alloc_flags are as for
+// page_alloc.  Requests up to 2^KMALLOC_MAX_SHIFT bytes come from the
+// power-of-two slab caches; larger ones get a whole page block.
+// Returns NULL if out of memory.
+//
+void *
+kmalloc(size_t size, int alloc_flags)
+{
+	struct PageInfo *pp;
+	void *p;
+	int shift;
+
+	if (size == 0)
+		return NULL;
+
+	for (shift = KMALLOC_MIN_SHIFT; (1UL << shift) < size; shift++)
+		;
+	if (shift <= KMALLOC_MAX_SHIFT) {
+		p = kmem_cache_alloc(kmalloc_caches[shift - KMALLOC_MIN_SHIFT]);
+		if (p && (alloc_flags & ALLOC_ZERO))
+			memset(p, 0, size);
+		return p;
+	}
+
+	shift = MAX(shift, PGSHIFT);
+	if (shift - PGSHIFT > PAGE_MAX_ORDER)
+		return NULL;
+	if (!(pp = page_alloc_order(shift - PGSHIFT, alloc_flags)))
+		return NULL;
+	pp->pp_flags |= PP_KMALLOC;
+	pp->pp_order = shift - PGSHIFT;
+	return page2kva(pp);
+}
+
+//
+// Free memory returned by kmalloc.  kfree(NULL) does nothing.
+//
+void
+kfree(void *p)
+{
+	struct PageInfo *pp;
+
+	if (p == NULL)
+		return;
+	pp = pa2page(PADDR(p));
+	if (pp->pp_flags & PP_SLAB)
+		kmem_cache_free(kmem_obj_slab(p)->sl_cache, p);
+	else if ((pp->pp_flags & PP_KMALLOC) && p == page2kva(pp)) {
+		pp->pp_flags &= ~PP_KMALLOC;
+		page_free_order(pp, pp->pp_order);
+	} else
+		panic("kfree: %p was not returned by kmalloc", p);
+}
+
+
+// --------------------------------------------------------------
+// Setup and statistics
+// --------------------------------------------------------------
+
+void
+kmem_init(void)
+{
+	static char names[KMALLOC_MAX_SHIFT - KMALLOC_MIN_SHIFT + 1][KMEM_NAME_LEN];
+	int i, r;
+
+	r = kmem_cache_setup(&kmem_cache_cache, "kmem_cache",
+			     sizeof(struct kmem_cache), 0, NULL);
+	assert(r == 0);
+
+	for (i = 0; i <= KMALLOC_MAX_SHIFT - KMALLOC_MIN_SHIFT; i++) {
+		snprintf(names[i], KMEM_NAME_LEN, "kmalloc-%lu",
+			 (uint64_t) (1 << (i + KMALLOC_MIN_SHIFT)));
+		kmalloc_caches[i] = kmem_cache_create(names[i],
+						      1 << (i + KMALLOC_MIN_SHIFT),
+						      0, NULL);
+		if (!kmalloc_caches[i])
+			panic("kmem_init: out of memory");
+	}
+
+	check_kmem();
+}
+
+void
+kmem_print_stats(void)
+{
+	struct kmem_cache *cp;
+
+	cprintf("cache              size  obj/slab  slabs   inuse      allocs  cpu-hit%%\n");
+	for (cp = kmem_caches; cp; cp = cp->kc_next)
+		cprintf("%-16s %6lu  %4lu/%lu  %5lu  %6lu  %10lu  %3lu%%\n",
+			cp->kc_name, (uint64_t) cp->kc_size,
+			(uint64_t) cp->kc_perslab, (uint64_t) (PGSIZE << cp->kc_order) / 1024,
+			(uint64_t) cp->kc_nslabs, (uint64_t) cp->kc_inuse,
+			cp->kc_allocs,
+			cp->kc_allocs ? cp->kc_cpu_hits * 100 / cp->kc_allocs : 0);
+}
+
+
+// --------------------------------------------------------------
+// Checking functions.
+// --------------------------------------------------------------
+
+static int check_kmem_ctor_calls;
+
+static void
+check_kmem_ctor(void *obj)
+{
+	*(uint64_t *) obj = 0xC0FFEE;
+	check_kmem_ctor_calls++;
+}
+
+//
+// Check kmem_cache and kmalloc.
+//
+static void
+check_kmem(void)
+{
+	struct kmem_cache *cp;
+	void *objs[100];
+	char *p;
+	int i, j;
+
+	// Objects are distinct, aligned and don't overlap.
+	cp = kmem_cache_create("check", 40, 64, NULL);
+	assert(cp);
+	for (i = 0; i < 100; i++) {
+		assert((objs[i] = kmem_cache_alloc(cp)));
+		assert((uintptr_t) objs[i] % 64 == 0);
+		memset(objs[i], i, 40);
+	}
+	for (i = 0; i < 100; i++)
+		for (j = 0; j < 40; j++)
+			assert(((char *) objs[i])[j] == (char) i);
+	assert(cp->kc_inuse == 100);
+	for (i = 0; i < 100; i++)
+		kmem_cache_free(cp, objs[i]);
+	assert(cp->kc_inuse == 0);
+	kmem_cache_destroy(cp);
+
+	// Constructors run once per object and constructed state survives
+	// a trip through the free lists.
+	check_kmem_ctor_calls = 0;
+	cp = kmem_cache_create("check-ctor", sizeof(uint64_t), 0, check_kmem_ctor);
+	assert(cp);
+	for (i = 0; i < 100; i++) {
+		assert((objs[i] = kmem_cache_alloc(cp)));
+		assert(*(uint64_t *) objs[i] == 0xC0FFEE);
+	}
+	assert(check_kmem_ctor_calls >= 100);
+	for (i = 0; i < 100; i++)
+		kmem_cache_free(cp, objs[i]);
+	j = check_kmem_ctor_calls;
+	for (i = 0; i < 100; i++) {
+		assert((objs[i] = kmem_cache_alloc(cp)));
+		assert(*(uint64_t *) objs[i] == 0xC0FFEE);
+	}
+	assert(check_kmem_ctor_calls == j);
+	for (i = 0; i < 100; i++)
+		kmem_cache_free(cp, objs[i]);
+	kmem_cache_destroy(cp);
+
+	// kmalloc picks a large enough class, and kfree finds it again.
+	for (i = 0; i < 100; i++) {
+		j = 1 + i * 97 % 6000;
+		assert((p = objs[i] = kmalloc(j, ALLOC_ZERO)));
+		assert(p[0] == 0 && p[j - 1] == 0);
+		memset(p, 0xAA, j);
+	}
+	for (i = 0; i < 100; i++)
+		kfree(objs[i]);
+	kfree(NULL);
+
+	cprintf("check_kmem() succeeded!\n");
+}
@@ -0,0 +1,31 @@
+/* See COPYRIGHT for copyright information. */
+
+#ifndef JOS_KERN_KMALLOC_H
+#define JOS_KERN_KMALLOC_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/types.h>
+
+// Size classes served by kmalloc from slab caches: 16, 32, ... 2048 bytes.
+// Larger requests are rounded up to a power-of-two block of pages.
+#define KMALLOC_MIN_SHIFT	4
+#define KMALLOC_MAX_SHIFT	11
+
+struct kmem_cache;
+
+void	kmem_init(void);
+
+struct kmem_cache *kmem_cache_create(const char *name, size_t size,
+				     size_t align, void (*ctor)(void *obj));
+void	kmem_cache_destroy(struct kmem_cache *cp);
+void *	kmem_cache_alloc(struct kmem_cache *cp);
+void	kmem_cache_free(struct kmem_cache *cp, void *obj);
+
+void *	kmalloc(size_t size, int alloc_flags);
+void	kfree(void *p);
+
+void	kmem_print_stats(void);
+
+#endif /* !JOS_KERN_KMALLOC_H */
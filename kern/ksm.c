@@ -0,0 +1,253 @@
+/* See COPYRIGHT for copyright information. */
+
+// Same-page merging for user memory.
+//
+// While the kernel is idle, the merger walks the user page tables of
+// every env and hashes the pages it finds.  A page of zeroes is
+// replaced by the shared zero page.  Two pages with the same contents
+// are merged into one physical page, mapped read-only in both places.
+// Mappings that were writable become PTE_COW, so a write to one takes a
+// private copy in page_fault_handler.  Merged mappings carry PTE_KSM.
+//
+// Pages are looked up in a direct-mapped table indexed by content hash:
+//  - A stable entry is a merged page.  All of its mappings are
+//    read-only, and the table holds a reference to it.
+//  - An unstable entry is a candidate.  It records one env's page that
+//    is still writable, which is why only pages with a single mapping
+//    are candidates.  The entry is checked again before use, and all
+//    unstable entries are forgotten after each pass, as the page may
+//    have changed in the meantime.
+// Hash collisions just mean a missed merge.
+
+#include <inc/mmu.h>
+#include <inc/stdio.h>
+#include <inc/string.h>
+#include <inc/assert.h>
+
+#include <kern/env.h>
+#include <kern/pmap.h>
+#include <kern/ksm.h>
+
+#define KSM_NENTRIES	1024	// Hash table size
+#define KSM_IDLE_BATCH	64	// Pages scanned per idle call
+
+struct KsmEntry {
+	uint32_t ke_hash;
+	bool ke_stable;
+	envid_t ke_env;			// Unstable: where the page is mapped
+	uintptr_t ke_va;
+	struct PageInfo *ke_page;	// NULL if the entry is empty
+};
+
+bool ksm_enabled;
+
+static struct KsmEntry ksm_table[KSM_NENTRIES];
+static uint32_t ksm_zero_hash;
+
+// Scan position: the env slot and user address to look at next.
+static int ksm_envx;
+static uintptr_t ksm_va;
+
+static uint64_t ksm_scanned, ksm_merged, ksm_zeroed, ksm_passes;
+
+static uint32_t
+ksm_hash(const void *page)
+{
+	const uint64_t *p = page;
+	uint64_t h = 14695981039346656037ULL;	// FNV-1a, a word at a time
+	int i;
+
+	for (i = 0; i < PGSIZE / 8; i++)
+		h = (h ^ p[i]) * 1099511628211ULL;
+	return h ^ (h >> 32);
+}
+
+//
+// Make the mapping *pte of 'va' in env e read-only and merged:
+// copy-on-write if it was writable, and tagged PTE_KSM.
+//
+static void
+ksm_protect(struct Env *e, pte_t *pte, uintptr_t va)
+{
+	if (*pte & PTE_W)
+		*pte = (*pte & ~PTE_W) | PTE_COW;
+	*pte |= PTE_KSM;
+	tlb_invalidate(e->env_pml4e, (void *) va);
+}
+
+//
+// Point the mapping *pte of 'va' in env e at 'pp' instead, with the
+// same permissions, read-only.  Drops the reference to the old page.
+//
+static void
+ksm_replace(struct Env *e, pte_t *pte, uintptr_t va, struct PageInfo *pp)
+{
+	struct PageInfo *old = pa2page(PTE_ADDR(*pte));
+
+	pp->pp_ref++;
+	*pte = page2pa(pp) | (*pte & 0xFFF);
+	ksm_protect(e, pte, va);
+	page_decref(old);
+}
+
+//
+// Returns the PTE through which the unstable entry 'ke' still maps its
+// page, alone, or NULL if that is no longer so.
+//
+static pte_t *
+ksm_check_unstable(struct KsmEntry *ke)
+{
+	struct Env *e;
+	pte_t *pte;
+
+	if (envid2env(ke->ke_env, &e, 0) < 0 || e->env_status == ENV_FREE)
+		return NULL;
+	pte = pml4e_walk(e->env_pml4e, (void *) ke->ke_va, 0);
+	if (!pte || (*pte & (PTE_P | PTE_PS)) != PTE_P ||
+	    pa2page(PTE_ADDR(*pte)) != ke->ke_page || ke->ke_page->pp_ref != 1)
+		return NULL;
+	return pte;
+}
+
+//
+// Try to merge the page mapped by *pte at 'va' in env e.
+//
+static void
+ksm_merge(struct Env *e, pte_t *pte, uintptr_t va)
+{
+	struct PageInfo *pp = pa2page(PTE_ADDR(*pte)), *cp;
+	struct KsmEntry *ke;
+	struct Env *ce;
+	pte_t *cpte;
+	uint32_t h;
+
+	if (pp == zero_page || (*pte & PTE_KSM) || !(*pte & PTE_U) ||
+	    pp->pp_ref != 1)
+		return;
+	ksm_scanned++;
+	h = ksm_hash(page2kva(pp));
+
+	if (h == ksm_zero_hash &&
+	    memcmp(page2kva(pp), page2kva(zero_page), PGSIZE) == 0) {
+		ksm_replace(e, pte, va, zero_page);
+		ksm_zeroed++;
+		return;
+	}
+
+	ke = &ksm_table[h % KSM_NENTRIES];
+	if (ke->ke_page && ke->ke_stable && ke->ke_page->pp_ref == 1) {
+		// Nothing maps the merged page any more.
+		page_decref(ke->ke_page);
+		ke->ke_page = NULL;
+	}
+	if (ke->ke_page && ke->ke_hash == h && ke->ke_stable) {
+		if (ke->ke_page->pp_ref < PP_REF_MAX &&
+		    memcmp(page2kva(pp), page2kva(ke->ke_page), PGSIZE) == 0) {
+			ksm_replace(e, pte, va, ke->ke_page);
+			ksm_merged++;
+		}
+		return;
+	}
+	if (ke->ke_page && ke->ke_hash == h && !ke->ke_stable &&
+	    (cpte = ksm_check_unstable(ke)) != NULL &&
+	    memcmp(page2kva(pp), page2kva(ke->ke_page), PGSIZE) == 0) {
+		// Two copies: the candidate becomes the merged page.
+		cp = ke->ke_page;
+		envid2env(ke->ke_env, &ce, 0);
+		ksm_protect(ce, cpte, ke->ke_va);
+		cp->pp_ref++;
+		ke->ke_stable = 1;
+		ksm_replace(e, pte, va, cp);
+		ksm_merged++;
+		return;
+	}
+	if (ke->ke_page && ke->ke_stable)
+		return;
+	ke->ke_hash = h;
+	ke->ke_stable = 0;
+	ke->ke_env = e->env_id;
+	ke->ke_va = va;
+	ke->ke_page = pp;
+}
+
+//
+// Look at up to 'npages' user pages, continuing where the last call
+// left off.  Returns the number of pages looked at.
+//
+int
+ksm_scan(int npages)
+{
+	struct Env *e;
+	uintptr_t va;
+	pte_t *pte;
+	int i, n = 0;
+
+	if (!envs || !zero_page)
+		return 0;
+	if (!ksm_zero_hash)
+		ksm_zero_hash = ksm_hash(page2kva(zero_page));
+
+	while (n < npages) {
+		e = &envs[ksm_envx];
+		if (e->env_status != ENV_FREE && e->env_pml4e &&
+		    (pte = pml4e_next_pte(e->env_pml4e, ksm_va, &va)) != NULL) {
+			ksm_merge(e, pte, va);
+			ksm_va = va + PGSIZE;
+			n++;
+			continue;
+		}
+		// On to the next env.
+		ksm_va = 0;
+		if (++ksm_envx < NENV)
+			continue;
+		// End of a pass: candidates may have changed since.
+		ksm_envx = 0;
+		ksm_passes++;
+		for (i = 0; i < KSM_NENTRIES; i++)
+			if (ksm_table[i].ke_page && !ksm_table[i].ke_stable)
+				ksm_table[i].ke_page = NULL;
+		break;
+	}
+	return n;
+}
+
+//
+// Run one whole pass, after finishing any pass already under way.
+//
+void
+ksm_scan_pass(void)
+{
+	uint64_t end = ksm_passes + 1 + (ksm_envx || ksm_va);
+
+	if (!envs || !zero_page)
+		return;
+	while (ksm_passes < end)
+		ksm_scan(NPTENTRIES);
+}
+
+void
+ksm_idle(void)
+{
+	extern const char *panicstr;
+
+	if (ksm_enabled && !panicstr)
+		ksm_scan(KSM_IDLE_BATCH);
+}
+
+void
+ksm_print_stats(void)
+{
+	int i, stable = 0;
+	uint64_t sharing = 0;
+
+	for (i = 0; i < KSM_NENTRIES; i++)
+		if (ksm_table[i].ke_page && ksm_table[i].ke_stable) {
+			stable++;
+			sharing += ksm_table[i].ke_page->pp_ref - 1;
+		}
+	cprintf("ksm: %s, %lu passes, %lu pages scanned\n",
+		ksm_enabled ? "on" : "off", ksm_passes, ksm_scanned);
+	cprintf("  %lu merged into %lu shared pages (%lu mappings now), "
+		"%lu replaced by the zero page\n",
+		ksm_merged, (uint64_t) stable, sharing, ksm_zeroed);
+}
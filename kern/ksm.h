@@ -0,0 +1,18 @@
+/* See COPYRIGHT for copyright information. */
+
+#ifndef JOS_KERN_KSM_H
+#define JOS_KERN_KSM_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/types.h>
+
+extern bool ksm_enabled;
+
+int	ksm_scan(int npages);
+void	ksm_scan_pass(void);
+void	ksm_idle(void);
+void	ksm_print_stats(void);
+
+#endif /* !JOS_KERN_KSM_H */
@@ -13,6 +13,14 @@
 #include <kern/kdebug.h>
 #include <kern/dwarf_api.h>
 #include <kern/trap.h>
+#include <kern/pmap.h>
+#include <kern/kmalloc.h>
+#include <kern/ksm.h>
+#include <kern/wss.h>
+#include <kern/ckpt.h>
+#include <kern/swap.h>
+#include <kern/sched.h>
+#include <kern/env.h>
 
 #define CMDBUF_SIZE	80	// enough for one VGA text line
 
@@ -28,6 +36,17 @@ static struct Command commands[] = {
 	{ "help", "Display this list of commands", mon_help },
 	{ "kerninfo", "Display information about the kernel", mon_kerninfo },
 	{ "backtrace", "Display the stack information", mon_backtrace },
+	{ "pagestat", "Display physical page allocator statistics", mon_pagestat },
+	{ "kmemstat", "Display kernel object cache statistics", mon_kmemstat },
+	{ "pagecolor", "Display free pages by cache colour, or set an env's colours", mon_pagecolor },
+	{ "tlbbench", "Time CR3 reloads with and without global kernel pages", mon_tlbbench },
+	{ "tlbcutoff", "Show or set the page count above which range flushes reload CR3", mon_tlbcutoff },
+	{ "ksm", "Show same-page merging statistics, turn it on or off, or run a pass", mon_ksm },
+	{ "wss", "Show working-set estimates, set the scan interval or scan now", mon_wss },
+	{ "dirtylog", "List an env's pages written since the last dirtylog", mon_dirtylog },
+	{ "ckpt", "Save an env to a checkpoint slot, or restore one", mon_ckpt },
+	{ "swap", "Show swap usage, or swap out some pages now", mon_swap },
+	{ "continue", "Leave the monitor and resume the env at its breakpoint", mon_continue },
 };
 #define NCOMMANDS (sizeof(commands)/sizeof(commands[0]))
 
@@ -47,6 +66,7 @@ int
 mon_kerninfo(int argc, char **argv, struct Trapframe *tf)
 {
 	extern char _start[], entry[], etext[], edata[], end[];
+	extern uint64_t boot_cycles;
 
 	cprintf("Special kernel symbols:\n");
 	cprintf("  _start                  %08x (phys)\n", _start);
@@ -56,6 +76,7 @@ mon_kerninfo(int argc, char **argv, struct Trapframe *tf)
 	cprintf("  end    %08x (virt)  %08x (phys)\n", end, end - KERNBASE);
 	cprintf("Kernel executable memory footprint: %dKB\n",
 		ROUNDUP(end - entry, 1024) / 1024);
+	cprintf("Boot to first env: %lu cycles\n", boot_cycles);
 	return 0;
 }
 
@@ -108,6 +129,243 @@ mon_backtrace(int argc, char **argv, struct Trapframe *tf)
 }
 
 
+int
+mon_pagestat(int argc, char **argv, struct Trapframe *tf)
+{
+	page_print_stats();
+	return 0;
+}
+
+// pagecolor [envid colour-mask]
+int
+mon_pagecolor(int argc, char **argv, struct Trapframe *tf)
+{
+	struct Env *e;
+	uint64_t mask;
+	int i;
+
+	if (argc == 3) {
+		if (envid2env(strtol(argv[1], NULL, 0), &e, 0) < 0) {
+			cprintf("pagecolor: no env %s\n", argv[1]);
+			return 0;
+		}
+		// A set with none of the machine's colours would make
+		// the env's next page allocation fail.
+		mask = strtol(argv[2], NULL, 0);
+		if (!(mask & page_color_valid())) {
+			cprintf("pagecolor: %s names none of the %lu colours\n",
+				argv[2], (uint64_t) page_ncolors);
+			return 0;
+		}
+		e->env_colors = mask;
+	} else if (argc != 1) {
+		cprintf("usage: pagecolor [envid colour-mask]\n");
+		return 0;
+	}
+
+	page_print_colors();
+	for (i = 0; i < NENV; i++)
+		if (envs[i].env_status != ENV_FREE && envs[i].env_colors != PAGE_COLOR_ALL)
+			cprintf("env %08x colours %016lx\n", envs[i].env_id,
+				envs[i].env_colors);
+	return 0;
+}
+
+// Average cycles for one CR3 reload followed by touching 'n' kernel
+// pages 2MB apart, as the kernel would after an address-space switch.
+static uint64_t
+tlbbench_run(int n)
+{
+	const int iters = 1000;
+	volatile char *p;
+	uint64_t start;
+	int i, j;
+
+	start = read_tsc();
+	for (i = 0; i < iters; i++) {
+		lcr3(rcr3());
+		for (j = 0, p = (char *) KERNBASE; j < n; j++, p += PTSIZE)
+			(void) *p;
+	}
+	return (read_tsc() - start) / iters;
+}
+
+// tlbbench [npages]
+int
+mon_tlbbench(int argc, char **argv, struct Trapframe *tf)
+{
+	int n = argc > 1 ? strtol(argv[1], NULL, 0) : 32;
+	uint64_t global, flushed;
+
+	n = MIN(n, (int) (npages * PGSIZE / PTSIZE));
+	global = tlbbench_run(n);
+	// Without PGE, every CR3 load flushes the kernel entries too.
+	lcr4(rcr4() & ~CR4_PGE);
+	flushed = tlbbench_run(n);
+	lcr4(rcr4() | CR4_PGE);
+
+	cprintf("CR3 reload + %lu kernel pages: %lu cycles with PTE_G, %lu without\n",
+		(uint64_t) n, global, flushed);
+	return 0;
+}
+
+// tlbcutoff [npages]
+int
+mon_tlbcutoff(int argc, char **argv, struct Trapframe *tf)
+{
+	if (argc > 1)
+		tlb_flush_cutoff = strtol(argv[1], NULL, 0);
+	cprintf("TLB range flush cutoff: %lu pages\n", (uint64_t) tlb_flush_cutoff);
+	return 0;
+}
+
+// ksm [on|off|scan]
+int
+mon_ksm(int argc, char **argv, struct Trapframe *tf)
+{
+	if (argc > 1 && strcmp(argv[1], "on") == 0)
+		ksm_enabled = 1;
+	else if (argc > 1 && strcmp(argv[1], "off") == 0)
+		ksm_enabled = 0;
+	else if (argc > 1 && strcmp(argv[1], "scan") == 0)
+		ksm_scan_pass();
+	else if (argc > 1) {
+		cprintf("usage: ksm [on|off|scan]\n");
+		return 0;
+	}
+	ksm_print_stats();
+	return 0;
+}
+
+// wss [scan | interval <cycles>]
+int
+mon_wss(int argc, char **argv, struct Trapframe *tf)
+{
+	if (argc > 1 && strcmp(argv[1], "scan") == 0)
+		wss_scan();
+	else if (argc > 2 && strcmp(argv[1], "interval") == 0)
+		wss_interval = strtol(argv[2], NULL, 0);
+	else if (argc > 1) {
+		cprintf("usage: wss [scan | interval <cycles>]\n");
+		return 0;
+	}
+	wss_print_stats();
+	return 0;
+}
+
+// dirtylog <envid> [va npages]
+int
+mon_dirtylog(int argc, char **argv, struct Trapframe *tf)
+{
+	uint8_t bitmap[256];
+	struct Env *e;
+	uintptr_t va = 0, start = 0, first;
+	size_t npages = UVA_END / PGSIZE, n, i, total;
+	uint64_t ndirty = 0;
+	bool dirty, run = 0;
+
+	if (argc != 2 && argc != 4) {
+		cprintf("usage: dirtylog <envid> [va npages]\n");
+		return 0;
+	}
+	if (envid2env(strtol(argv[1], NULL, 16), &e, 0) < 0 || !e->env_pml4e) {
+		cprintf("dirtylog: no env %s\n", argv[1]);
+		return 0;
+	}
+	if (argc == 4) {
+		va = ROUNDDOWN(strtol(argv[2], NULL, 0), PGSIZE);
+		npages = MIN((size_t) strtol(argv[3], NULL, 0),
+			     (UVA_END - MIN(va, UVA_END)) / PGSIZE);
+	}
+
+	// Print each run of dirty pages as a range.
+	first = va;
+	total = npages;
+	for (; npages > 0; npages -= n) {
+		n = MIN(npages, sizeof(bitmap) * 8);
+		ndirty += page_dirty_log(e->env_pml4e, va, n, bitmap);
+		for (i = 0; i < n; i++, va += PGSIZE) {
+			dirty = bitmap[i / 8] & (1 << (i % 8));
+			if (dirty && !run) {
+				start = va;
+				run = 1;
+			} else if (!dirty && run) {
+				cprintf("  %08lx-%08lx\n", start, va);
+				run = 0;
+			}
+		}
+	}
+	if (run)
+		cprintf("  %08lx-%08lx\n", start, va);
+	page_dirty_log_huge(e->env_pml4e, first, total);
+	cprintf("%lu dirty pages\n", ndirty);
+	return 0;
+}
+
+// ckpt save <envid> <slot> | ckpt restore <slot>
+int
+mon_ckpt(int argc, char **argv, struct Trapframe *tf)
+{
+	struct Env *e;
+	int r;
+
+	if (argc == 4 && strcmp(argv[1], "save") == 0) {
+		if (envid2env(strtol(argv[2], NULL, 16), &e, 0) < 0 ||
+		    e->env_status == ENV_FREE) {
+			cprintf("ckpt: no env %s\n", argv[2]);
+			return 0;
+		}
+		if ((r = ckpt_save(e, strtol(argv[3], NULL, 0), 0, 0)) < 0)
+			cprintf("ckpt save: %e\n", r);
+		return 0;
+	}
+	if (argc == 3 && strcmp(argv[1], "restore") == 0) {
+		if ((r = ckpt_restore(strtol(argv[2], NULL, 0), 0, &e)) < 0) {
+			cprintf("ckpt restore: %e\n", r);
+			return 0;
+		}
+		cprintf("[%08x] restored from slot %s\n", e->env_id, argv[2]);
+		// From the idle monitor, go and run it.
+		if (!tf)
+			sched_yield();
+		return 0;
+	}
+	cprintf("usage: ckpt save <envid> <slot> | ckpt restore <slot>\n");
+	return 0;
+}
+
+// swap [out <npages>]
+int
+mon_swap(int argc, char **argv, struct Trapframe *tf)
+{
+	if (argc == 3 && strcmp(argv[1], "out") == 0)
+		cprintf("%lu pages swapped out\n",
+			(uint64_t) swap_out(strtol(argv[2], NULL, 0)));
+	else if (argc > 1) {
+		cprintf("usage: swap [out <npages>]\n");
+		return 0;
+	}
+	swap_print_stats();
+	return 0;
+}
+
+int
+mon_continue(int argc, char **argv, struct Trapframe *tf)
+{
+	if (!tf || (tf->tf_cs & 3) != 3 || tf->tf_trapno != T_BRKPT) {
+		cprintf("continue: not stopped at a user breakpoint\n");
+		return 0;
+	}
+	return -1;
+}
+
+int
+mon_kmemstat(int argc, char **argv, struct Trapframe *tf)
+{
+	kmem_print_stats();
+	return 0;
+}
+
 
 /***** Kernel monitor command interpreter *****/
 
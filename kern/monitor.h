@@ -15,5 +15,16 @@ void monitor(struct Trapframe *tf);
 int mon_help(int argc, char **argv, struct Trapframe *tf);
 int mon_kerninfo(int argc, char **argv, struct Trapframe *tf);
 int mon_backtrace(int argc, char **argv, struct Trapframe *tf);
+int mon_pagestat(int argc, char **argv, struct Trapframe *tf);
+int mon_kmemstat(int argc, char **argv, struct Trapframe *tf);
+int mon_pagecolor(int argc, char **argv, struct Trapframe *tf);
+int mon_tlbbench(int argc, char **argv, struct Trapframe *tf);
+int mon_tlbcutoff(int argc, char **argv, struct Trapframe *tf);
+int mon_ksm(int argc, char **argv, struct Trapframe *tf);
+int mon_wss(int argc, char **argv, struct Trapframe *tf);
+int mon_dirtylog(int argc, char **argv, struct Trapframe *tf);
+int mon_ckpt(int argc, char **argv, struct Trapframe *tf);
+int mon_swap(int argc, char **argv, struct Trapframe *tf);
+int mon_continue(int argc, char **argv, struct Trapframe *tf);
 
 #endif	// !JOS_KERN_MONITOR_H
@@ -46,19 +46,53 @@ extern pml4e_t *boot_pml4e;
 enum {
 	// For page_alloc, zero the returned physical page.
 	ALLOC_ZERO = 1<<0,
+	// For page_alloc_order, only take a block that is on the buddy
+	// lists already: don't initialise deferred pages or reclaim
+	// parked ones to make one.
+	ALLOC_NORECLAIM = 1<<1,
 };
 
+// The buddy allocator hands out naturally aligned blocks of 2^order
+// pages, up to 2^PAGE_MAX_ORDER pages (4MB).
+#define PAGE_MAX_ORDER	10
+
 void    x64_vm_init();
 
 void	page_init(void);
 struct PageInfo * page_alloc(int alloc_flags);
+struct PageInfo * page_alloc_order(int order, int alloc_flags);
 void	page_free(struct PageInfo *pp);
+void	page_free_order(struct PageInfo *pp, int order);
+void	page_free_bulk(struct PageInfo **pp, size_t n);
+int	page_alloc_bulk(size_t n, int alloc_flags, struct PageInfo **out);
+struct PageInfo *page_alloc_run(size_t n, size_t align, int alloc_flags);
+bool	page_is_free(struct PageInfo *pp);
+struct PageInfo *page_alloc_color(uint64_t colors, int alloc_flags);
+int	page_alloc_bulk_color(size_t n, uint64_t colors, int alloc_flags,
+			      struct PageInfo **out);
+void	page_print_colors(void);
+void	page_print_stats(void);
+void	page_idle(void);
+size_t	page_deferred_npages(void);
 int	page_insert(pml4e_t *pml4e, struct PageInfo *pp, void *va, int perm);
-void	page_remove(pml4e_t *pml4e, void *va);
+int	page_map_range(pml4e_t *pml4e, void *va, struct PageInfo **pp, size_t n, int perm);
+int	page_remove(pml4e_t *pml4e, void *va);
+int	page_dirty_log(pml4e_t *pml4e, uintptr_t va, size_t npages, uint8_t *bitmap);
+void	page_dirty_log_huge(pml4e_t *pml4e, uintptr_t va, size_t npages);
+int	page_remove_range(pml4e_t *pml4e, void *va, size_t len);
+int	page_map_huge(pml4e_t *pml4e, void *va, int perm, int alloc_flags);
+int	pml4e_cow_copy(pml4e_t *dst, pml4e_t *src);
+int	page_cow_fault(struct Env *e, void *va);
 struct PageInfo *page_lookup(pml4e_t *pml4e, void *va, pte_t **pte_store);
 void	page_decref(struct PageInfo *pp);
 
+extern int tlb_flush_cutoff;
+extern struct PageInfo *zero_page;
+extern uint64_t page_table_gen;
+
 void	tlb_invalidate(pml4e_t *pml4e, void *va);
+void	tlb_invalidate_range(pml4e_t *pml4e, void *va, size_t len);
+void	tlb_switch(struct Env *e);
 
 int	user_mem_check(struct Env *env, const void *va, size_t len, int perm);
 void	user_mem_assert(struct Env *env, const void *va, size_t len, int perm);
@@ -83,6 +117,54 @@ pa2page(physaddr_t pa)
 	return &pages[PPN(pa)];
 }
 
+// Page colours: bit c of a colour set stands for colour c.
+#define PAGE_MAX_COLOR_SHIFT	6
+#define PAGE_MAX_COLORS		(1 << PAGE_MAX_COLOR_SHIFT)
+#define PAGE_COLOR_ALL		(~(uint64_t) 0)
+
+extern int page_ncolors;
+
+static inline int
+page_color(struct PageInfo *pp)
+{
+	return page2ppn(pp) & (page_ncolors - 1);
+}
+
+// The colour set of every colour this machine has.  A colour set with
+// none of these can't allocate anything.
+static inline uint64_t
+page_color_valid(void)
+{
+	if (page_ncolors >= PAGE_MAX_COLORS)
+		return PAGE_COLOR_ALL;
+	return (1UL << page_ncolors) - 1;
+}
+
+// Follow and set the page-number links of a PageInfo (see inc/memlayout.h).
+static inline struct PageInfo *
+page_next(struct PageInfo *pp)
+{
+	return pp->pp_link ? &pages[pp->pp_link] : NULL;
+}
+
+static inline struct PageInfo *
+page_prev(struct PageInfo *pp)
+{
+	return pp->pp_prev ? &pages[pp->pp_prev] : NULL;
+}
+
+static inline void
+page_set_next(struct PageInfo *pp, struct PageInfo *next)
+{
+	pp->pp_link = next ? page2ppn(next) : 0;
+}
+
+static inline void
+page_set_prev(struct PageInfo *pp, struct PageInfo *prev)
+{
+	pp->pp_prev = prev ? page2ppn(prev) : 0;
+}
+
 static inline void*
 page2kva(struct PageInfo *pp)
 {
@@ -92,6 +174,8 @@ page2kva(struct PageInfo *pp)
 pte_t *pgdir_walk(pde_t *pgdir, const void *va, int create);
 
 pte_t *pml4e_walk(pml4e_t *pml4e, const void *va, int create);
+int	pml4e_walk_split(pml4e_t *pml4e, const void *va, int create, pte_t **pte_store);
+pte_t *pml4e_next_pte(pml4e_t *pml4e, uintptr_t va, uintptr_t *va_store);
 
 pde_t *pdpe_walk(pdpe_t *pdpe,const void *va,int create);
 
@@ -0,0 +1,123 @@
+/* See COPYRIGHT for copyright information. */
+
+// Zero-fill-on-demand memory.
+//
+// sys_region_reserve records a range of an env's address space without
+// allocating anything.  The first read of a page in it maps the shared
+// zero page read-only; the first write (or a write after that read)
+// maps a page from the pre-zeroed pool.  So a sparse array or a big
+// heap only costs the pages actually touched.
+//
+// In a writable region the zero page is mapped PTE_COW, so the write
+// fault that replaces it goes through page_cow_fault like any other
+// copy-on-write page, and fork shares it like one.
+
+#include <inc/mmu.h>
+#include <inc/error.h>
+
+#include <kern/env.h>
+#include <kern/pmap.h>
+#include <kern/kmalloc.h>
+#include <kern/region.h>
+
+//
+// Reserve [va, va+len) in env e's address space for zero-filled pages
+// with permissions 'perm'.  Pages already mapped there are left alone.
+//
+// RETURNS:
+//   0 on success
+//   -E_INVAL, if the range overlaps an existing region
+//   -E_NO_MEM, if the region can't be recorded
+//
+int
+region_reserve(struct Env *e, uintptr_t va, size_t len, int perm)
+{
+	struct VmRegion **prev, *r;
+
+	for (prev = &e->env_regions; *prev; prev = &(*prev)->vr_next) {
+		if ((*prev)->vr_start >= va + len)
+			break;
+		if ((*prev)->vr_end > va)
+			return -E_INVAL;
+	}
+	if (!(r = kmalloc(sizeof(*r), 0)))
+		return -E_NO_MEM;
+	r->vr_start = va;
+	r->vr_end = va + len;
+	r->vr_perm = perm;
+	r->vr_next = *prev;
+	*prev = r;
+	return 0;
+}
+
+//
+// Handle a page fault at 'va' with error code 'err' in env e by backing
+// the page, if it lies in one of e's regions.
+//
+// RETURNS:
+//   0 if the page is now mapped
+//   -E_FAULT, if the fault is not one a region explains
+//   -E_NO_MEM, if there's no memory to back the page
+//
+int
+region_fault(struct Env *e, uintptr_t va, uint32_t err)
+{
+	struct VmRegion *r;
+	struct PageInfo *pp;
+	int perm, ret;
+
+	for (r = e->env_regions; r && r->vr_start <= va; r = r->vr_next)
+		if (va < r->vr_end)
+			break;
+	if (!r || va < r->vr_start || (err & FEC_PR))
+		return -E_FAULT;
+
+	va = ROUNDDOWN(va, PGSIZE);
+	if (!(err & FEC_WR)) {
+		perm = r->vr_perm & ~PTE_W;
+		if (r->vr_perm & PTE_W)
+			perm |= PTE_COW;
+		return page_insert(e->env_pml4e, zero_page, (void *) va, perm);
+	}
+	if (!(r->vr_perm & PTE_W))
+		return -E_FAULT;
+	if (!(pp = page_alloc_color(e->env_colors, ALLOC_ZERO)))
+		return -E_NO_MEM;
+	if ((ret = page_insert(e->env_pml4e, pp, (void *) va, r->vr_perm)) < 0)
+		page_free(pp);
+	return ret;
+}
+
+//
+// Give env 'dst', which has no regions, a copy of src's regions (fork).
+//
+int
+region_copy(struct Env *dst, struct Env *src)
+{
+	struct VmRegion **prev = &dst->env_regions, *r, *n;
+
+	for (r = src->env_regions; r; r = r->vr_next) {
+		if (!(n = kmalloc(sizeof(*n), 0)))
+			return -E_NO_MEM;
+		*n = *r;
+		n->vr_next = NULL;
+		*prev = n;
+		prev = &n->vr_next;
+	}
+	return 0;
+}
+
+//
+// Forget all of env e's regions.  The pages backing them are freed with
+// the rest of its address space.
+//
+void
+region_free_all(struct Env *e)
+{
+	struct VmRegion *r;
+
+	while ((r = e->env_regions) != NULL) {
+		e->env_regions = r->vr_next;
+		kfree(r);
+	}
+}
@@ -0,0 +1,27 @@
+/* See COPYRIGHT for copyright information. */
+
+#ifndef JOS_KERN_REGION_H
+#define JOS_KERN_REGION_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/types.h>
+
+struct Env;
+
+// A range of an env's address space that is backed on demand by
+// zero-filled pages.
+struct VmRegion {
+	uintptr_t vr_start;		// First address, page aligned
+	uintptr_t vr_end;		// Just past the last address
+	int vr_perm;			// PTE bits the pages get
+	struct VmRegion *vr_next;	// Next region, in address order
+};
+
+int	region_reserve(struct Env *e, uintptr_t va, size_t len, int perm);
+int	region_fault(struct Env *e, uintptr_t va, uint32_t err);
+int	region_copy(struct Env *dst, struct Env *src);
+void	region_free_all(struct Env *e);
+
+#endif /* !JOS_KERN_REGION_H */
@@ -0,0 +1,59 @@
+#include <inc/assert.h>
+#include <inc/x86.h>
+
+#include <kern/env.h>
+#include <kern/pmap.h>
+#include <kern/monitor.h>
+#include <kern/sched.h>
+#include <kern/wss.h>
+
+void sched_halt(void) __attribute__((noreturn));
+
+// Choose a user environment to run and run it.
+void
+sched_yield(void)
+{
+	struct Env *idle;
+	int i, start;
+
+	wss_tick();
+
+	// Implement simple round-robin scheduling.
+	//
+	// Search through 'envs' for an ENV_RUNNABLE environment in
+	// circular fashion starting just after the env this CPU was
+	// last running.  Switch to the first such environment found.
+	//
+	// If no envs are runnable, but the environment previously
+	// running on this CPU is still ENV_RUNNING, it's okay to
+	// choose that environment.
+	//
+	// Never choose an environment that's currently running on
+	// another CPU (env_status == ENV_RUNNING).  If there are
+	// no runnable environments, simply drop through to the code
+	// below to halt the cpu.
+	start = curenv ? ENVX(curenv->env_id) + 1 : 0;
+	for (i = 0; i < NENV; i++) {
+		idle = &envs[(start + i) % NENV];
+		if (idle->env_status == ENV_RUNNABLE)
+			env_run(idle);
+	}
+	if (curenv && curenv->env_status == ENV_RUNNING)
+		env_run(curenv);
+
+	// sched_halt never returns
+	sched_halt();
+}
+
+// Halt this CPU when there is nothing to do.  With no timer interrupt
+// to wake us up, that means dropping into the monitor.
+void
+sched_halt(void)
+{
+	curenv = NULL;
+	lcr3(boot_cr3);
+
+	cprintf("Destroyed the only environment - nothing more to do!\n");
+	while (1)
+		monitor(NULL);
+}
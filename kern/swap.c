@@ -0,0 +1,146 @@
+/* See COPYRIGHT for copyright information. */
+
+// Swapping user pages out to the second disk when memory runs out.
+//
+// When page_alloc finds no free page, swap_out picks cold user pages
+// with the clock algorithm: a hand sweeps over the 4KB mappings of every
+// env in turn.  How recently a page was used is read from the working
+// set scanner's PTE_AGE bits and PTE_A, which the hand leaves for the
+// scanner to clear (kern/wss.c).  A page the hand takes is written to a
+// free swap page, and its PTE becomes an on-disk PTE naming that page
+// (see kern/diskmap.c), which brings it back on the next touch.  The
+// swap page is free again once no PTE names it.
+//
+// Only pages mapped once are swapped, since there is no way to find
+// the other PTEs of a shared page.  The zero page and 2MB mappings are
+// left alone.
+
+#include <inc/mmu.h>
+#include <inc/error.h>
+#include <inc/stdio.h>
+#include <inc/x86.h>
+
+#include <kern/env.h>
+#include <kern/pmap.h>
+#include <kern/diskmap.h>
+#include <kern/swap.h>
+
+// Working-set scans a page must have gone unused for on the first lap.
+#define SWAP_COLD_AGE	4
+
+// The clock hand: the env slot and user address to look at next.
+static int swap_envx;
+static uintptr_t swap_va;
+
+static uint64_t swap_nout, swap_scanned;
+
+//
+// Write the page mapped by *pte at 'va' in env e to swap and unmap it.
+// Returns 0 on success, -E_INVAL if the page can't be swapped, and
+// -E_NO_MEM or a disk error if swap is full or failing.
+//
+static int
+swap_page(struct Env *e, pte_t *pte, uintptr_t va)
+{
+	struct PageInfo *pp = pa2page(PTE_ADDR(*pte));
+	int slot, perm, r;
+
+	if (pp == zero_page || pp->pp_ref != 1)
+		return -E_INVAL;
+	if ((slot = diskmap_alloc(SWAP_START, SWAP_NPAGES)) < 0)
+		return slot;
+	if ((r = diskmap_write(slot, page2kva(pp))) < 0)
+		return r;
+
+	// A copy-on-write page mapped once is as good as writable.  The
+	// dirty bit goes along, for page_dirty_log.
+	perm = *pte & (PTE_SYSCALL | PTE_D);
+	if (*pte & PTE_COW)
+		perm |= PTE_W;
+	*pte = 0;
+	diskmap_set(pte, slot, perm);
+	tlb_invalidate(e->env_pml4e, (void *) va);
+	page_decref(pp);
+	swap_nout++;
+	return 0;
+}
+
+//
+// Returns true if the clock hand may take pages from env e.
+//
+static bool
+swap_env_ok(struct Env *e)
+{
+	// While the kernel works in the address space of an env that is
+	// not curenv (load_icode), a fault on it could not be resolved.
+	return e->env_status != ENV_FREE && e->env_pml4e &&
+		(e == curenv || PTE_ADDR(rcr3()) != e->env_cr3);
+}
+
+//
+// Returns true if the hand may take the page mapped by 'pte' on lap
+// 'lap'.  Each lap settles for less: a page unused for SWAP_COLD_AGE
+// scans, then one unused since the last scan, and last, so that memory
+// can still be found when the scanner is off, any page.
+//
+static bool
+swap_cold(pte_t pte, int lap)
+{
+	if (lap == 0)
+		return !(pte & PTE_A) && PTE_AGE(pte) >= SWAP_COLD_AGE;
+	if (lap == 1)
+		return !(pte & PTE_A);
+	return 1;
+}
+
+//
+// Swap out up to 'npages' cold user pages.  The hand goes round at most
+// three times, taking warmer pages each time (see swap_cold).  Returns
+// the number of pages freed.
+//
+int
+swap_out(int npages)
+{
+	static bool busy;
+	struct Env *e;
+	uintptr_t va;
+	pte_t *pte;
+	int r, n = 0, laps = 0;
+
+	if (!envs || !ide_present || busy)
+		return 0;
+	busy = 1;
+	while (n < npages && laps < 3) {
+		e = &envs[swap_envx];
+		if (swap_env_ok(e) &&
+		    (pte = pml4e_next_pte(e->env_pml4e, swap_va, &va)) != NULL) {
+			swap_va = va + PGSIZE;
+			swap_scanned++;
+			if (!swap_cold(*pte, laps))
+				continue;
+			if ((r = swap_page(e, pte, va)) == 0)
+				n++;
+			else if (r != -E_INVAL)
+				break;
+			continue;
+		}
+		// On to the next env.
+		swap_va = 0;
+		if (++swap_envx == NENV) {
+			swap_envx = 0;
+			laps++;
+		}
+	}
+	busy = 0;
+	return n;
+}
+
+void
+swap_print_stats(void)
+{
+	cprintf("swap: %lu of %lu pages in use\n",
+		(uint64_t) diskmap_count(SWAP_START, SWAP_NPAGES),
+		(uint64_t) SWAP_NPAGES);
+	cprintf("  %lu pages swapped out, %lu mappings scanned\n",
+		swap_nout, swap_scanned);
+}
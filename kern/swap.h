@@ -0,0 +1,22 @@
+/* See COPYRIGHT for copyright information. */
+
+#ifndef JOS_KERN_SWAP_H
+#define JOS_KERN_SWAP_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/types.h>
+#include <kern/ide.h>
+#include <kern/ckpt.h>
+
+// Swap takes the part of the second disk after the checkpoint slots.
+#define SWAP_START	(CKPT_NSLOTS * CKPT_SLOT_NPAGES)
+#define SWAP_NPAGES	(DISK_NPAGES - SWAP_START)
+
+#define SWAP_BATCH	32	// Pages page_alloc sends out at a time
+
+int	swap_out(int npages);
+void	swap_print_stats(void);
+
+#endif /* !JOS_KERN_SWAP_H */
@@ -14,24 +14,44 @@
 #include <kern/trap.h>
 #include <kern/syscall.h>
 #include <kern/console.h>
+#include <kern/uaccess.h>
+#include <kern/sched.h>
+#include <kern/region.h>
+#include <kern/diskmap.h>
+#include <kern/ckpt.h>
 
 
 static int sys_env_destroy(envid_t envid);
 
+// A user copy failed: report it the way user_mem_assert does and
+// destroy the current environment.
+static void
+user_fault(void)
+{
+	cprintf("[%08x] user_mem_check assertion failure for "
+		"va %08x\n", curenv->env_id, uaccess_fault_va);
+	env_destroy(curenv);
+}
+
 // Print a string to the system console.
 // The string is exactly 'len' characters long.
 // Destroys the environment on memory errors.
 static void
 sys_cputs(const char *s, size_t len)
 {
-	// Check that the user has permission to read memory [s, s+len).
-	// Destroy the environment if not.
-
-	// LAB 3: Your code here.
-	(user_mem_assert(curenv, s, len, PTE_U));
+	char buf[256];
+	size_t n;
 
-	// Print the string supplied by the user.
-	cprintf("%.*s", len, s);
+	// Copy the string in through a bounce buffer rather than checking
+	// the page tables first; a fault destroys the environment.
+	for (; len > 0; s += n, len -= n) {
+		n = MIN(len, sizeof(buf));
+		if (copy_from_user(buf, s, n) < 0) {
+			user_fault();
+			return;
+		}
+		cprintf("%.*s", n, buf);
+	}
 }
 
 // Read a character from the system console without blocking.
@@ -70,6 +90,446 @@ sys_env_destroy(envid_t envid)
 	return 0;
 }
 
+// Deschedule current environment and pick a different one to run.
+static void
+sys_yield(void)
+{
+	sched_yield();
+}
+
+// Allocate a new environment.
+// Returns envid of new environment, or < 0 on error.  Errors are:
+//	-E_NO_FREE_ENV if no free environment is available.
+//	-E_NO_MEM on memory exhaustion.
+static envid_t
+sys_exofork(void)
+{
+	struct Env *e;
+	int r;
+
+	if ((r = env_alloc(&e, curenv->env_id)) < 0)
+		return r;
+	// The child starts out with our registers, but returns 0, and
+	// stays put until its parent has set up its address space.
+	e->env_status = ENV_NOT_RUNNABLE;
+	e->env_tf = curenv->env_tf;
+	e->env_tf.tf_regs.reg_rax = 0;
+	e->env_colors = curenv->env_colors;
+	return e->env_id;
+}
+
+// Fork the current environment: like sys_exofork, but the child also
+// gets a copy-on-write copy of our address space and is made runnable.
+// Returns envid of new environment, or < 0 on error.  Errors are:
+//	-E_NO_FREE_ENV if no free environment is available.
+//	-E_NO_MEM on memory exhaustion.
+static envid_t
+sys_fork(void)
+{
+	struct Env *e;
+	envid_t envid;
+	int r;
+
+	if ((envid = sys_exofork()) < 0)
+		return envid;
+	e = &envs[ENVX(envid)];
+	if ((r = pml4e_cow_copy(e->env_pml4e, curenv->env_pml4e)) < 0 ||
+	    (r = region_copy(e, curenv)) < 0) {
+		env_free(e);
+		return r;
+	}
+	e->env_status = ENV_RUNNABLE;
+	return envid;
+}
+
+// Set envid's env_status to status, which must be ENV_RUNNABLE
+// or ENV_NOT_RUNNABLE.
+//
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_BAD_ENV if environment envid doesn't currently exist,
+//		or the caller doesn't have permission to change envid.
+//	-E_INVAL if status is not a valid status for an environment.
+static int
+sys_env_set_status(envid_t envid, int status)
+{
+	struct Env *e;
+	int r;
+
+	if (status != ENV_RUNNABLE && status != ENV_NOT_RUNNABLE)
+		return -E_INVAL;
+	if ((r = envid2env(envid, &e, 1)) < 0)
+		return r;
+	e->env_status = status;
+	return 0;
+}
+
+// Check that 'va' is a page-aligned address in the env's own part of
+// the address space and 'perm' are permissions a user may ask for.
+static int
+check_va_perm(void *va, int perm)
+{
+	if ((uintptr_t) va >= UVA_END || PGOFF(va))
+		return -E_INVAL;
+	if ((perm & (PTE_U | PTE_P)) != (PTE_U | PTE_P) || (perm & ~PTE_SYSCALL))
+		return -E_INVAL;
+	return 0;
+}
+
+// sys_page_alloc for the 2MB at 'va'.
+static int
+sys_page_alloc_huge(envid_t envid, void *va, int perm)
+{
+	struct PageInfo *batch[NPTENTRIES];
+	struct Env *e;
+	int i, r;
+
+	if ((r = check_va_perm(va, perm)) < 0)
+		return r;
+	if ((uintptr_t) va % PTSIZE)
+		return -E_INVAL;
+	if ((r = envid2env(envid, &e, 1)) < 0)
+		return r;
+	if (e->env_colors == PAGE_COLOR_ALL &&
+	    page_map_huge(e->env_pml4e, va, perm, ALLOC_ZERO) == 0)
+		return 0;
+	if (page_alloc_bulk_color(NPTENTRIES, e->env_colors, ALLOC_ZERO, batch) < 0)
+		return -E_NO_MEM;
+	if ((r = page_map_range(e->env_pml4e, va, batch, NPTENTRIES, perm)) < 0) {
+		// page_map_range maps all of one page table or none of it.
+		for (i = 0; i < NPTENTRIES; i++)
+			page_free(batch[i]);
+		return r;
+	}
+	return 0;
+}
+
+// Allocate a page of memory and map it at 'va' with permission
+// 'perm' in the address space of 'envid'.
+// The page's contents are set to 0.
+// If a page is already mapped at 'va', that page is unmapped as a
+// side effect.
+//
+// perm -- PTE_U | PTE_P must be set, PTE_AVAIL | PTE_W may or may not be set,
+//         but no other bits may be set.  See PTE_SYSCALL in inc/mmu.h.
+//         As an exception, PTE_PS asks for the whole 2MB at 'va', which
+//         must then be 2MB aligned.  A single 2MB page is used if one is
+//         free and nothing is mapped there yet, otherwise 512 pages.
+//
+// Return 0 on success, < 0 on error.  Errors are:
+//	-E_BAD_ENV if environment envid doesn't currently exist,
+//		or the caller doesn't have permission to change envid.
+//	-E_INVAL if va >= UVA_END, or va is not page-aligned.
+//	-E_INVAL if perm is inappropriate (see above).
+//	-E_NO_MEM if there's no memory to allocate the new page,
+//		or to allocate any necessary page tables.
+static int
+sys_page_alloc(envid_t envid, void *va, int perm)
+{
+	struct Env *e;
+	struct PageInfo *pp;
+	int r;
+
+	if (perm & PTE_PS)
+		return sys_page_alloc_huge(envid, va, perm & ~PTE_PS);
+	if ((r = check_va_perm(va, perm)) < 0)
+		return r;
+	if ((r = envid2env(envid, &e, 1)) < 0)
+		return r;
+	if (!(pp = page_alloc_color(e->env_colors, ALLOC_ZERO)))
+		return -E_NO_MEM;
+	if ((r = page_insert(e->env_pml4e, pp, va, perm)) < 0) {
+		page_free(pp);
+		return r;
+	}
+	return 0;
+}
+
+// Get env e's page at 'va' ready to be shared with 'perm', as an access
+// by e would: read it in if it is on disk, back it if it is an
+// untouched page of a zero-fill region, and if perm asks for PTE_W and
+// the page is copy-on-write (after fork, or merged by kern/ksm.c), give
+// e its own copy first.
+static void
+page_share_prepare(struct Env *e, void *va, int perm)
+{
+	pte_t *pte;
+
+	diskmap_fault(e, (uintptr_t) va);
+	if (!page_lookup(e->env_pml4e, va, &pte))
+		region_fault(e, (uintptr_t) va, (perm & PTE_W) ? FEC_WR : 0);
+	if ((perm & PTE_W) && page_lookup(e->env_pml4e, va, &pte) &&
+	    (*pte & PTE_COW))
+		page_cow_fault(e, va);
+}
+
+// Map the page of memory at 'srcva' in srcenvid's address space
+// at 'dstva' in dstenvid's address space with permission 'perm'.
+// Perm has the same restrictions as in sys_page_alloc, except
+// that it also must not grant write access to a read-only
+// page.  (A copy-on-write page is made private to srcenvid first.)
+//
+// Return 0 on success, < 0 on error.  Errors are:
+//	-E_BAD_ENV if srcenvid and/or dstenvid doesn't currently exist,
+//		or the caller doesn't have permission to change one of them.
+//	-E_INVAL if srcva >= UVA_END or srcva is not page-aligned,
+//		or dstva >= UVA_END or dstva is not page-aligned.
+//	-E_INVAL is srcva is not mapped in srcenvid's address space.
+//	-E_INVAL if perm is inappropriate (see sys_page_alloc).
+//	-E_INVAL if (perm & PTE_W), but srcva is read-only in srcenvid's
+//		address space.
+//	-E_NO_MEM if there's no memory to allocate any necessary page tables.
+static int
+sys_page_map(envid_t srcenvid, void *srcva,
+	     envid_t dstenvid, void *dstva, int perm)
+{
+	struct Env *src, *dst;
+	struct PageInfo *pp;
+	pte_t *pte;
+	int r;
+
+	if ((r = check_va_perm(srcva, PTE_U | PTE_P)) < 0 ||
+	    (r = check_va_perm(dstva, perm)) < 0)
+		return r;
+	if ((r = envid2env(srcenvid, &src, 1)) < 0 ||
+	    (r = envid2env(dstenvid, &dst, 1)) < 0)
+		return r;
+	page_share_prepare(src, srcva, perm);
+	if (!(pp = page_lookup(src->env_pml4e, srcva, &pte)))
+		return -E_INVAL;
+	if ((perm & PTE_W) && !(*pte & PTE_W))
+		return -E_INVAL;
+	return page_insert(dst->env_pml4e, pp, dstva, perm);
+}
+
+// Unmap the page of memory at 'va' in the address space of 'envid'.
+// If no page is mapped, the function silently succeeds.
+//
+// Return 0 on success, < 0 on error.  Errors are:
+//	-E_BAD_ENV if environment envid doesn't currently exist,
+//		or the caller doesn't have permission to change envid.
+//	-E_INVAL if va >= UVA_END, or va is not page-aligned.
+//	-E_NO_MEM if va lies in a 2MB page that can't be split.
+static int
+sys_page_unmap(envid_t envid, void *va)
+{
+	struct Env *e;
+	int r;
+
+	if ((r = check_va_perm(va, PTE_U | PTE_P)) < 0)
+		return r;
+	if ((r = envid2env(envid, &e, 1)) < 0)
+		return r;
+	return page_remove(e->env_pml4e, va);
+}
+
+// Reserve [va, va+len) of the current environment for memory that is
+// allocated, zero-filled, the first time each page is touched.
+// 'perm' is as for sys_page_alloc.
+//
+// Return 0 on success, < 0 on error.  Errors are:
+//	-E_INVAL if va is not page-aligned, len is 0, or the range
+//		reaches UVA_END.
+//	-E_INVAL if perm is inappropriate (see sys_page_alloc).
+//	-E_INVAL if the range overlaps a region reserved before.
+//	-E_NO_MEM if the region can't be recorded.
+static int
+sys_region_reserve(void *va, size_t len, int perm)
+{
+	int r;
+
+	if ((r = check_va_perm(va, perm)) < 0)
+		return r;
+	len = ROUNDUP(len, PGSIZE);
+	if (len == 0 || len > UVA_END - (uintptr_t) va)
+		return -E_INVAL;
+	return region_reserve(curenv, (uintptr_t) va, len, perm);
+}
+
+// Report which of the 'npages' pages from 'va' in envid's address space
+// were written since the last call that covered them, and start
+// tracking them afresh.  Bit i of 'bitmap' (bit i%8 of byte i/8) is set
+// if page va+i*PGSIZE is dirty.  A page mapped since the last call
+// counts as dirty; an unmapped page as clean.  See page_dirty_log.
+//
+// Returns the number of dirty pages on success, < 0 on error.
+// Errors are:
+//	-E_BAD_ENV if environment envid doesn't currently exist,
+//		or the caller doesn't have permission to change envid.
+//	-E_INVAL if va is not page-aligned or the range reaches UVA_END.
+// Destroys the environment if it can't write to 'bitmap'.
+static int
+sys_env_dirty_log(envid_t envid, void *va, size_t npages, uint8_t *bitmap)
+{
+	uint8_t buf[256];
+	struct Env *e;
+	uintptr_t start;
+	size_t n, total;
+	int r, ndirty = 0;
+
+	if ((r = check_va_perm(va, PTE_U | PTE_P)) < 0)
+		return r;
+	if (npages > (UVA_END - (uintptr_t) va) / PGSIZE)
+		return -E_INVAL;
+	if ((r = envid2env(envid, &e, 1)) < 0)
+		return r;
+
+	// Harvest through a bounce buffer, one bitmap chunk at a time.
+	// A 2MB page split between chunks has its dirty bit cleared after.
+	start = (uintptr_t) va;
+	total = npages;
+	for (; npages > 0; npages -= n, va += n * PGSIZE) {
+		n = MIN(npages, sizeof(buf) * 8);
+		ndirty += page_dirty_log(e->env_pml4e, (uintptr_t) va, n, buf);
+		if (copy_to_user(bitmap, buf, ROUNDUP(n, 8) / 8) < 0) {
+			user_fault();
+			return -E_FAULT;
+		}
+		bitmap += sizeof(buf);
+	}
+	page_dirty_log_huge(e->env_pml4e, start, total);
+	return ndirty;
+}
+
+// Save env 'envid' to checkpoint slot 'slot' on disk, replacing the
+// image there.  If the env saves itself, the copy later restored from
+// the image sees this call return 1.  Only the caller and its parent
+// may restore the image.
+//
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_BAD_ENV if environment envid doesn't currently exist,
+//		or the caller doesn't have permission to change envid.
+//	-E_INVAL if there is no such slot, or an env restored from it
+//		still has pages there.
+//	-E_BAD_ENV if the slot holds an image saved by an env other
+//		than the caller or one of its children.
+//	-E_NO_MEM if the env doesn't fit in a slot.
+//	-E_NO_DISK, -E_IO on disk trouble.
+static int
+sys_env_checkpoint(envid_t envid, int slot)
+{
+	struct Env *e;
+	int r;
+
+	if ((r = envid2env(envid, &e, 1)) < 0)
+		return r;
+	return ckpt_save(e, slot, curenv->env_id, e == curenv);
+}
+
+// Create a child env from the image in checkpoint slot 'slot'.  It
+// starts where the saved env was, and is runnable.  Its memory is read
+// from disk a page at a time, as it touches it.
+// Returns envid of new environment, or < 0 on error.  Errors are:
+//	-E_INVAL if there is no such slot, or no image in it.
+//	-E_BAD_ENV if the image was saved by an env other than the
+//		caller or one of its children.
+//	-E_NO_FREE_ENV if no free environment is available.
+//	-E_NO_MEM on memory exhaustion.
+//	-E_NO_DISK, -E_IO on disk trouble.
+static envid_t
+sys_env_restore(int slot)
+{
+	struct Env *e;
+	int r;
+
+	if ((r = ckpt_restore(slot, curenv->env_id, &e)) < 0)
+		return r;
+	return e->env_id;
+}
+
+// Try to send 'value' to the target env 'envid'.
+// If srcva < UTOP, then also send page currently mapped at 'srcva',
+// so that receiver gets a duplicate mapping of the same page.
+//
+// The send fails with a return value of -E_IPC_NOT_RECV if the
+// target is not blocked, waiting for an IPC.
+//
+// Otherwise, the send succeeds, and the target's ipc fields are
+// updated: env_ipc_recving is cleared, env_ipc_from is set to the
+// sending envid, env_ipc_value to 'value', and env_ipc_perm to 'perm'
+// if a page was transferred, 0 otherwise.  The target is marked
+// runnable again, returning 0 from the paused sys_ipc_recv system call.
+//
+// If the sender wants to send a page but the receiver isn't asking for
+// one, then no page mapping is transferred, but no error occurs.
+// The ipc only happens when no errors occur.
+//
+// Returns 0 on success, < 0 on error.
+// Errors are:
+//	-E_BAD_ENV if environment envid doesn't currently exist.
+//		(No need to check permissions.)
+//	-E_IPC_NOT_RECV if envid is not currently blocked in sys_ipc_recv,
+//		or another environment managed to send first.
+//	-E_INVAL if srcva < UTOP but srcva is not page-aligned,
+//		or not below UVA_END.
+//	-E_INVAL if srcva < UTOP and perm is inappropriate
+//		(see sys_page_alloc).
+//	-E_INVAL if srcva < UTOP but srcva is not mapped in the caller's
+//		address space.
+//	-E_INVAL if (perm & PTE_W), but srcva is read-only in the
+//		current environment's address space.
+//	-E_NO_MEM if there's not enough memory to map srcva in envid's
+//		address space.
+static int
+sys_ipc_try_send(envid_t envid, uint32_t value, void *srcva, unsigned perm)
+{
+	struct Env *e;
+	struct PageInfo *pp;
+	pte_t *pte;
+	int r;
+
+	if ((r = envid2env(envid, &e, 0)) < 0)
+		return r;
+	if (!e->env_ipc_recving)
+		return -E_IPC_NOT_RECV;
+
+	e->env_ipc_perm = 0;
+	if ((uintptr_t) srcva < UTOP) {
+		if ((r = check_va_perm(srcva, perm)) < 0)
+			return r;
+		page_share_prepare(curenv, srcva, perm);
+		if (!(pp = page_lookup(curenv->env_pml4e, srcva, &pte)))
+			return -E_INVAL;
+		if ((perm & PTE_W) && !(*pte & PTE_W))
+			return -E_INVAL;
+		if ((uintptr_t) e->env_ipc_dstva < UTOP) {
+			if ((r = page_insert(e->env_pml4e, pp, e->env_ipc_dstva, perm)) < 0)
+				return r;
+			e->env_ipc_perm = perm;
+		}
+	}
+
+	e->env_ipc_recving = 0;
+	e->env_ipc_from = curenv->env_id;
+	e->env_ipc_value = value;
+	e->env_status = ENV_RUNNABLE;
+	e->env_tf.tf_regs.reg_rax = 0;
+	return 0;
+}
+
+// Block until a value is ready.  Record that you want to receive
+// using the env_ipc_recving and env_ipc_dstva fields of struct Env,
+// mark yourself not runnable, and then give up the CPU.
+//
+// If 'dstva' is < UTOP, then you are willing to receive a page of data.
+// 'dstva' is the virtual address at which the sent page should be mapped.
+//
+// This function only returns on error, but the system call will eventually
+// return 0 on success.
+// Return < 0 on error.  Errors are:
+//	-E_INVAL if dstva < UTOP but dstva is not page-aligned, or
+//		not below UVA_END.
+static int
+sys_ipc_recv(void *dstva)
+{
+	if ((uintptr_t) dstva < UTOP &&
+	    (PGOFF(dstva) || (uintptr_t) dstva >= UVA_END))
+		return -E_INVAL;
+	curenv->env_ipc_recving = 1;
+	curenv->env_ipc_dstva = dstva;
+	curenv->env_status = ENV_NOT_RUNNABLE;
+	sched_yield();
+}
+
 
 // Dispatches to the correct kernel function, passing the arguments.
 int64_t
@@ -86,6 +546,19 @@ syscall(uint64_t syscallno, uint64_t a1, uint64_t a2, uint64_t a3, uint64_t a4,
 	case SYS_cgetc: return sys_cgetc();
 	case SYS_env_destroy: return sys_env_destroy((envid_t)a1);
 	case SYS_getenvid: return sys_getenvid();	
+	case SYS_page_alloc: return sys_page_alloc((envid_t)a1, (void*)a2, (int)a3);
+	case SYS_page_map: return sys_page_map((envid_t)a1, (void*)a2, (envid_t)a3, (void*)a4, (int)a5);
+	case SYS_page_unmap: return sys_page_unmap((envid_t)a1, (void*)a2);
+	case SYS_exofork: return sys_exofork();
+	case SYS_fork: return sys_fork();
+	case SYS_env_set_status: return sys_env_set_status((envid_t)a1, (int)a2);
+	case SYS_yield: sys_yield(); return 0;
+	case SYS_ipc_try_send: return sys_ipc_try_send((envid_t)a1, (uint32_t)a2, (void*)a3, (unsigned)a4);
+	case SYS_ipc_recv: return sys_ipc_recv((void*)a1);
+	case SYS_region_reserve: return sys_region_reserve((void*)a1, (size_t)a2, (int)a3);
+	case SYS_env_checkpoint: return sys_env_checkpoint((envid_t)a1, (int)a2);
+	case SYS_env_restore: return sys_env_restore((int)a1);
+	case SYS_env_dirty_log: return sys_env_dirty_log((envid_t)a1, (void*)a2, (size_t)a3, (uint8_t*)a4);
 
 	default:
 		return -E_NO_SYS;
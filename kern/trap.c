@@ -8,6 +8,9 @@
 #include <kern/monitor.h>
 #include <kern/env.h>
 #include <kern/syscall.h>
+#include <kern/uaccess.h>
+#include <kern/region.h>
+#include <kern/diskmap.h>
 
 extern uintptr_t gdtdesc_64;
 struct Taskstate ts;
@@ -193,11 +196,17 @@ trap_dispatch(struct Trapframe *tf)
 {
 	// Handle processor exceptions.
 	// LAB 3: Your code here.
-	if (tf->tf_trapno == T_PGFLT)
+	if (tf->tf_trapno == T_PGFLT) {
 		page_fault_handler(tf);
-	
-	if (tf->tf_trapno == T_BRKPT)
+		return;
+	}
+
+
+	// The env resumes if the monitor is left with 'continue'.
+	if (tf->tf_trapno == T_BRKPT) {
 		monitor(tf);
+		return;
+	}
 
 	if (tf->tf_trapno == T_SYSCALL) {
 		struct PushRegs *regs = &tf->tf_regs;
@@ -254,6 +263,10 @@ trap(struct Trapframe *tf)
 	// Dispatch based on what type of trap occurred
 	trap_dispatch(tf);
 
+	// A fault the kernel recovered from (a user copy): resume it.
+	if ((tf->tf_cs & 3) == 0)
+		env_pop_tf(tf);
+
 	// Return to the current environment, which should be running.
 	assert(curenv && curenv->env_status == ENV_RUNNING);
 	env_run(curenv);
@@ -264,6 +277,7 @@ void
 page_fault_handler(struct Trapframe *tf)
 {
 	uint64_t fault_va;
+	uintptr_t fixup;
 
 	// Read processor's CR2 register to find the faulting address
 	fault_va = rcr2();
@@ -271,8 +285,30 @@ page_fault_handler(struct Trapframe *tf)
 	// Handle kernel-mode page faults.
 	// LAB 3: Your code here.
 
-	if (tf->tf_cs == GD_KT)
+	// Write faults on copy-on-write pages, including writes from
+	// copy_to_user, are resolved by giving the env its own copy.
+	if ((tf->tf_err & (FEC_PR | FEC_WR)) == (FEC_PR | FEC_WR) &&
+	    fault_va < UTOP && curenv &&
+	    page_cow_fault(curenv, (void *) fault_va) == 0)
+		return;
+	// Pages on disk: swapped out, or not yet read from a checkpoint.
+	if (fault_va < UTOP && curenv && !(tf->tf_err & FEC_PR) &&
+	    diskmap_fault(curenv, fault_va) == 0)
+		return;
+	// Untouched pages of zero-fill-on-demand regions.
+	if (fault_va < UTOP && curenv &&
+	    region_fault(curenv, fault_va, tf->tf_err) == 0)
+		return;
+
+	if (tf->tf_cs == GD_KT) {
+		// Faults in copy_from_user and friends return -E_FAULT.
+		if ((fixup = uaccess_fixup(tf->tf_rip)) != 0) {
+			uaccess_fault_va = fault_va;
+			tf->tf_rip = fixup;
+			return;
+		}
 		panic("Page fault in kernel!\n");
+	}
 
 
 	// We've already handled kernel-mode exceptions, so if we get here,
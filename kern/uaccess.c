@@ -0,0 +1,142 @@
+/* See COPYRIGHT for copyright information. */
+
+#include <inc/memlayout.h>
+#include <inc/error.h>
+
+#include <kern/uaccess.h>
+
+// Copying to and from user memory.
+//
+// Rather than checking every page of a user buffer against the page
+// tables first, these just touch it.  The instructions that may fault
+// are listed in the exception table (the __ex_table section), together
+// with the address to resume at.  page_fault_handler looks a faulting
+// kernel %rip up there and jumps to the fixup, which makes the copy
+// return -E_FAULT.
+//
+// The range is still checked against ULIM (UTOP for writes), since the
+// kernel could otherwise read or write its own memory.  Below ULIM
+// every page mapped is a user page, and CR0_WP keeps the kernel from
+// writing to read-only ones.
+
+struct ExTableEntry {
+	uintptr_t insn;		// Instruction that may fault
+	uintptr_t fixup;	// Where to resume if it does
+};
+
+extern const struct ExTableEntry __EX_TABLE_BEGIN__[], __EX_TABLE_END__[];
+
+uintptr_t uaccess_fault_va;
+
+#define EX_TABLE(insn, fixup)				\
+	".pushsection __ex_table, \"a\"\n"		\
+	"\t.balign 8\n"					\
+	"\t.quad " #insn ", " #fixup "\n"		\
+	".popsection\n"
+
+//
+// Returns the fixup address for a fault at kernel address 'rip', or 0
+// if faults there are not expected.
+//
+uintptr_t
+uaccess_fixup(uintptr_t rip)
+{
+	const struct ExTableEntry *e;
+
+	for (e = __EX_TABLE_BEGIN__; e < __EX_TABLE_END__; e++)
+		if (e->insn == rip)
+			return e->fixup;
+	return 0;
+}
+
+//
+// Check that [va, va+len) lies below 'lim'.  Otherwise note the
+// offending address, as user_mem_check would, and return -E_FAULT.
+//
+static int
+uaccess_range(uintptr_t va, size_t len, uintptr_t lim)
+{
+	if (va + len < va || va + len > lim) {
+		uaccess_fault_va = va > lim ? va : lim + PGSIZE;
+		return -E_FAULT;
+	}
+	return 0;
+}
+
+static int
+uaccess_copy(void *dst, const void *src, size_t len)
+{
+	int r;
+
+	__asm __volatile("1:\trep movsb\n"
+			 "\txorl %0, %0\n"
+			 "\tjmp 3f\n"
+			 "2:\tmovl %4, %0\n"
+			 "3:\n"
+			 EX_TABLE(1b, 2b)
+			 : "=&r" (r), "+D" (dst), "+S" (src), "+c" (len)
+			 : "i" (-E_FAULT)
+			 : "memory", "cc");
+	return r;
+}
+
+//
+// Copy 'len' bytes from user address 'usrc' to 'dst'.
+// Returns 0, or -E_FAULT if part of the source is not readable.
+//
+int
+copy_from_user(void *dst, const void *usrc, size_t len)
+{
+	int r;
+
+	if ((r = uaccess_range((uintptr_t) usrc, len, ULIM)) < 0)
+		return r;
+	return uaccess_copy(dst, usrc, len);
+}
+
+//
+// Copy 'len' bytes from 'src' to user address 'udst'.
+// Returns 0, or -E_FAULT if part of the destination is not writable.
+//
+int
+copy_to_user(void *udst, const void *src, size_t len)
+{
+	int r;
+
+	if ((r = uaccess_range((uintptr_t) udst, len, UTOP)) < 0)
+		return r;
+	return uaccess_copy(udst, src, len);
+}
+
+//
+// Copy the NUL-terminated string at user address 'usrc' into 'dst',
+// which holds 'len' bytes.  Only the bytes up to the NUL need to be
+// readable.  Returns the length of the string, or 'len' if it did not
+// fit (in which case 'dst' is not terminated), or -E_FAULT.
+//
+int
+strncpy_from_user(char *dst, const char *usrc, size_t len)
+{
+	size_t i;
+	char c;
+	int r;
+
+	for (i = 0; i < len; i++) {
+		if ((r = uaccess_range((uintptr_t) (usrc + i), 1, ULIM)) < 0)
+			return r;
+		__asm __volatile("1:\tmovb (%2), %1\n"
+				 "\txorl %0, %0\n"
+				 "\tjmp 3f\n"
+				 "2:\tmovl %3, %0\n"
+				 "3:\n"
+				 EX_TABLE(1b, 2b)
+				 : "=&r" (r), "=&q" (c)
+				 : "r" (usrc + i), "i" (-E_FAULT)
+				 : "cc");
+		if (r < 0)
+			return r;
+		if ((dst[i] = c) == '\0')
+			return i;
+	}
+	return len;
+}
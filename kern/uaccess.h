@@ -0,0 +1,20 @@
+/* See COPYRIGHT for copyright information. */
+
+#ifndef JOS_KERN_UACCESS_H
+#define JOS_KERN_UACCESS_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/types.h>
+
+// Address that made the last user copy fail, for error messages.
+extern uintptr_t uaccess_fault_va;
+
+int	copy_from_user(void *dst, const void *usrc, size_t len);
+int	copy_to_user(void *udst, const void *src, size_t len);
+int	strncpy_from_user(char *dst, const char *usrc, size_t len);
+
+uintptr_t uaccess_fixup(uintptr_t rip);
+
+#endif /* !JOS_KERN_UACCESS_H */
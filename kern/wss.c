@@ -0,0 +1,139 @@
+/* See COPYRIGHT for copyright information. */
+
+// Working-set estimation from the PTE accessed bits.
+//
+// Every wss_interval cycles the scanner walks the user page tables of
+// every env.  For each mapping it reads and clears PTE_A, and keeps in
+// the PTE's age bits the number of scans since PTE_A was last found set.
+// A page is in the working set over a window of k scans if its age is
+// below k; the counts for each window in WSS_WINDOW are stored in the
+// Env, where the env can read them through envs[].
+//
+// The processor sets PTE_A only when it loads a translation into the
+// TLB, so the env's TLB entries are dropped after its bits are cleared.
+// A 2MB mapping has a single accessed bit and counts as 512 pages.
+
+#include <inc/mmu.h>
+#include <inc/x86.h>
+#include <inc/stdio.h>
+#include <inc/string.h>
+
+#include <kern/env.h>
+#include <kern/pmap.h>
+#include <kern/wss.h>
+
+uint64_t wss_interval = 100000000;	// Cycles between scans; 0: on demand only
+
+static uint64_t wss_last_tsc;
+static uint64_t wss_nscans, wss_cycles;
+
+//
+// Age the mapping *pte, which covers 'npages' pages, and count it into
+// rss and the working-set windows.
+//
+static void
+wss_age(pte_t *pte, uint32_t npages, uint32_t *rss, uint32_t *wss)
+{
+	uint64_t age = PTE_AGE(*pte);
+	int i;
+
+	if (*pte & PTE_A)
+		age = 0;
+	else if (age < PTE_AGE_MAX)
+		age++;
+	*pte = (*pte & ~(PTE_A | PTE_AGE_MASK)) | (age << PTE_AGE_SHIFT);
+
+	*rss += npages;
+	for (i = 0; i < WSS_NWINDOWS; i++)
+		if (age < WSS_WINDOW(i))
+			wss[i] += npages;
+}
+
+static void
+wss_scan_table(physaddr_t pa, int level, uint32_t *rss, uint32_t *wss)
+{
+	uint64_t *t = KADDR(pa);
+	int i;
+
+	for (i = 0; i < NPTENTRIES; i++) {
+		if (!(t[i] & PTE_P))
+			continue;
+		if (level == 1)
+			wss_age(&t[i], 1, rss, wss);
+		else if (level == 2 && (t[i] & PTE_PS))
+			wss_age(&t[i], NPTENTRIES, rss, wss);
+		else
+			wss_scan_table(PTE_ADDR(t[i]), level - 1, rss, wss);
+	}
+}
+
+static void
+wss_scan_env(struct Env *e)
+{
+	uint32_t rss = 0, wss[WSS_NWINDOWS];
+
+	memset(wss, 0, sizeof(wss));
+	if (e->env_pml4e[0] & PTE_P) {
+		wss_scan_table(PTE_ADDR(e->env_pml4e[0]), 3, &rss, wss);
+		tlb_invalidate_range(e->env_pml4e, 0, UTOP);
+	}
+	e->env_rss = rss;
+	memcpy(e->env_wss, wss, sizeof(wss));
+	e->env_wss_scans++;
+}
+
+//
+// Scan every env now.
+//
+void
+wss_scan(void)
+{
+	uint64_t start = read_tsc();
+	int i;
+
+	if (!envs)
+		return;
+	for (i = 0; i < NENV; i++)
+		if (envs[i].env_status != ENV_FREE && envs[i].env_pml4e)
+			wss_scan_env(&envs[i]);
+	wss_nscans++;
+	wss_last_tsc = read_tsc();
+	wss_cycles += wss_last_tsc - start;
+}
+
+//
+// Scan if wss_interval cycles have passed since the last scan.
+// Called on every trip through the scheduler and the idle loop.
+//
+void
+wss_tick(void)
+{
+	extern const char *panicstr;
+
+	if (wss_interval && !panicstr && read_tsc() - wss_last_tsc >= wss_interval)
+		wss_scan();
+}
+
+void
+wss_print_stats(void)
+{
+	struct Env *e;
+	int i, j;
+
+	cprintf("%lu scans every %lu cycles, %lu cycles per scan\n",
+		wss_nscans, wss_interval,
+		wss_nscans ? wss_cycles / wss_nscans : (uint64_t) 0);
+	cprintf("env       rss     ");
+	for (j = 0; j < WSS_NWINDOWS; j++)
+		cprintf("wss/%-4lu ", (uint64_t) WSS_WINDOW(j));
+	cprintf("\n");
+	for (i = 0; i < NENV; i++) {
+		e = &envs[i];
+		if (e->env_status == ENV_FREE)
+			continue;
+		cprintf("%08x  %-8lu", e->env_id, (uint64_t) e->env_rss);
+		for (j = 0; j < WSS_NWINDOWS; j++)
+			cprintf(" %-8lu", (uint64_t) e->env_wss[j]);
+		cprintf("\n");
+	}
+}
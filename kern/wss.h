@@ -0,0 +1,17 @@
+/* See COPYRIGHT for copyright information. */
+
+#ifndef JOS_KERN_WSS_H
+#define JOS_KERN_WSS_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/types.h>
+
+extern uint64_t wss_interval;
+
+void	wss_scan(void);
+void	wss_tick(void);
+void	wss_print_stats(void);
+
+#endif /* !JOS_KERN_WSS_H */
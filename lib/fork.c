@@ -0,0 +1,25 @@
+// Copy-on-write fork.
+
+#include <inc/lib.h>
+
+//
+// User-level fork with copy-on-write.
+// The kernel duplicates our page tables in sys_fork: writable pages are
+// shared read-only and marked PTE_COW in both address spaces, and the
+// first write to one gets a private copy in the page fault handler.
+// Read-only pages are simply shared.
+//
+// Returns: child's envid to the parent, 0 to the child, < 0 on error.
+//
+envid_t
+fork(void)
+{
+	envid_t envid;
+
+	if ((envid = sys_fork()) < 0)
+		return envid;
+	if (envid == 0)
+		// We're the child.  Our thisenv still points at the parent.
+		thisenv = &envs[ENVX(sys_getenvid())];
+	return envid;
+}
@@ -26,6 +26,10 @@ static const char * const error_string[MAXERROR] =
 	[E_NO_MEM]	= "out of memory",
 	[E_NO_FREE_ENV]	= "out of environments",
 	[E_FAULT]	= "segmentation fault",
+	[E_NO_SYS]	= "unimplemented system call",
+	[E_IPC_NOT_RECV]= "env is not recving",
+	[E_NO_DISK]	= "no disk",
+	[E_IO]		= "disk I/O error",
 };
 
 /*
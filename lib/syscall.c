@@ -61,3 +61,77 @@ sys_getenvid(void)
 	return syscall(SYS_getenvid, 0, 0, 0, 0, 0, 0);
 }
 
+
+void
+sys_yield(void)
+{
+	syscall(SYS_yield, 0, 0, 0, 0, 0, 0);
+}
+
+envid_t
+sys_fork(void)
+{
+	return syscall(SYS_fork, 0, 0, 0, 0, 0, 0);
+}
+
+int
+sys_page_alloc(envid_t envid, void *va, int perm)
+{
+	return syscall(SYS_page_alloc, 1, envid, (uint64_t) va, perm, 0, 0);
+}
+
+int
+sys_page_map(envid_t srcenv, void *srcva, envid_t dstenv, void *dstva, int perm)
+{
+	return syscall(SYS_page_map, 1, srcenv, (uint64_t) srcva, dstenv, (uint64_t) dstva, perm);
+}
+
+int
+sys_page_unmap(envid_t envid, void *va)
+{
+	return syscall(SYS_page_unmap, 1, envid, (uint64_t) va, 0, 0, 0);
+}
+
+// sys_exofork is inlined in lib.h
+
+int
+sys_env_set_status(envid_t envid, int status)
+{
+	return syscall(SYS_env_set_status, 1, envid, status, 0, 0, 0);
+}
+
+int
+sys_ipc_try_send(envid_t envid, uint32_t value, void *srcva, int perm)
+{
+	return syscall(SYS_ipc_try_send, 0, envid, value, (uint64_t) srcva, perm, 0);
+}
+
+int
+sys_ipc_recv(void *dstva)
+{
+	return syscall(SYS_ipc_recv, 1, (uint64_t) dstva, 0, 0, 0, 0);
+}
+
+int
+sys_region_reserve(void *va, size_t len, int perm)
+{
+	return syscall(SYS_region_reserve, 1, (uint64_t) va, len, perm, 0, 0);
+}
+
+int
+sys_env_dirty_log(envid_t envid, void *va, size_t npages, uint8_t *bitmap)
+{
+	return syscall(SYS_env_dirty_log, 0, envid, (uint64_t) va, npages, (uint64_t) bitmap, 0);
+}
+
+int
+sys_env_checkpoint(envid_t envid, int slot)
+{
+	return syscall(SYS_env_checkpoint, 0, envid, slot, 0, 0, 0);
+}
+
+envid_t
+sys_env_restore(int slot)
+{
+	return syscall(SYS_env_restore, 0, slot, 0, 0, 0, 0);
+}
@@ -0,0 +1,81 @@
+// test checkpoints: save ourselves, restore a copy that reads the saved
+// memory back from disk as it touches it, and check that only the
+// saver may restore or replace the image
+
+#include <inc/lib.h>
+
+#define REGION	((char *) 0x10000000)
+#define NPAGES	32
+#define SLOT	0
+
+int generation = 1;
+
+static void
+restored(void)
+{
+	int i;
+
+	// We're the copy: our thisenv still points at the original.
+	thisenv = &envs[ENVX(sys_getenvid())];
+	if (generation != 1)
+		panic("copy sees data written after the checkpoint");
+	for (i = 0; i < NPAGES - 2; i++)
+		if (REGION[i * PGSIZE] != 'a' + i % 26)
+			panic("copy lost region page %d", i);
+	// One page was only read and one never touched: both zero, and
+	// still writable.
+	for (i = NPAGES - 2; i < NPAGES; i++) {
+		if (REGION[i * PGSIZE] != 0)
+			panic("copy's region page %d isn't zero", i);
+		REGION[i * PGSIZE] = 1;
+	}
+	REGION[0] = 'c';
+	cprintf("restored copy sees the saved memory\n");
+	ipc_send(thisenv->env_parent_id, 0, 0, 0);
+}
+
+void
+umain(int argc, char **argv)
+{
+	envid_t who;
+	int i, r;
+
+	if ((r = sys_region_reserve(REGION, NPAGES * PGSIZE, PTE_P | PTE_U | PTE_W)) < 0)
+		panic("sys_region_reserve: %e", r);
+	for (i = 0; i < NPAGES - 2; i++)
+		REGION[i * PGSIZE] = 'a' + i % 26;
+	if (REGION[(NPAGES - 2) * PGSIZE] != 0)
+		panic("region isn't zero");
+
+	if ((r = sys_env_checkpoint(0, SLOT)) < 0)
+		panic("sys_env_checkpoint: %e", r);
+	if (r == 1) {
+		restored();
+		return;
+	}
+	generation = 2;
+	REGION[0] = 'z';
+	cprintf("checkpoint saved\n");
+
+	// A child of ours didn't save the image, so may not restore or
+	// replace it.
+	if ((who = fork()) < 0)
+		panic("fork: %e", who);
+	if (who == 0) {
+		if ((r = sys_env_restore(SLOT)) != -E_BAD_ENV)
+			panic("child restored its parent's image: %e", r);
+		if ((r = sys_env_checkpoint(0, SLOT)) != -E_BAD_ENV)
+			panic("child replaced its parent's image: %e", r);
+		cprintf("child may not restore or replace the image\n");
+		ipc_send(thisenv->env_parent_id, 0, 0, 0);
+		return;
+	}
+	ipc_recv(0, 0, 0);
+
+	if ((who = sys_env_restore(SLOT)) < 0)
+		panic("sys_env_restore: %e", who);
+	ipc_recv(0, 0, 0);
+	if (generation != 2 || REGION[0] != 'z' || REGION[(NPAGES - 1) * PGSIZE] != 0)
+		panic("original sees the copy's writes");
+	cprintf("original unaffected by the copy\n");
+}
@@ -0,0 +1,66 @@
+// test sys_env_dirty_log on 4KB pages and on a 2MB page, including a
+// 2MB page the kernel harvests in two chunks
+
+#include <inc/lib.h>
+
+#define SMALL	((char *) 0x10000000)
+#define HUGE	((char *) 0x20000000)
+
+// Bitmap for a harvest from 1600 pages below HUGE to its end, which
+// the kernel has to do in two chunks.
+#define SPLIT_VA	(HUGE - 1600 * PGSIZE)
+#define SPLIT_NPAGES	(1600 + NPTENTRIES)
+
+uint8_t bitmap[SPLIT_NPAGES / 8];
+
+static int
+harvest(void *va, size_t npages)
+{
+	int r;
+
+	if ((r = sys_env_dirty_log(0, va, npages, bitmap)) < 0)
+		panic("sys_env_dirty_log: %e", r);
+	return r;
+}
+
+void
+umain(int argc, char **argv)
+{
+	int i, r;
+
+	for (i = 0; i < 8; i++)
+		if ((r = sys_page_alloc(0, SMALL + i * PGSIZE, PTE_P | PTE_U | PTE_W)) < 0)
+			panic("sys_page_alloc: %e", r);
+	if (harvest(SMALL, 8) != 8 || bitmap[0] != 0xff)
+		panic("new pages aren't dirty");
+	if (harvest(SMALL, 8) != 0)
+		panic("harvested pages are still dirty");
+	SMALL[3 * PGSIZE] = 1;
+	if (harvest(SMALL, 8) != 1 || bitmap[0] != (1 << 3))
+		panic("written page isn't the dirty one");
+	if (harvest(SMALL, 8) != 0)
+		panic("written page is still dirty");
+	cprintf("dirty log round trip ok\n");
+
+	// A 2MB page if one is free, else 512 pages: a write dirties
+	// either the whole 2MB or the one page.
+	if ((r = sys_page_alloc(0, HUGE, PTE_P | PTE_U | PTE_W | PTE_PS)) < 0)
+		panic("sys_page_alloc 2MB: %e", r);
+	if (HUGE[0] != 0 || HUGE[PTSIZE - 1] != 0)
+		panic("2MB page isn't zero");
+	if (harvest(HUGE, NPTENTRIES) != NPTENTRIES)
+		panic("new 2MB page isn't dirty");
+	HUGE[5 * PGSIZE] = 1;
+	r = harvest(HUGE, NPTENTRIES);
+	if ((r != 1 && r != NPTENTRIES) || !(bitmap[0] & (1 << 5)))
+		panic("written 2MB page isn't dirty");
+	if (harvest(HUGE, NPTENTRIES) != 0)
+		panic("2MB page is still dirty");
+	HUGE[7 * PGSIZE] = 1;
+	r = harvest(SPLIT_VA, SPLIT_NPAGES);
+	if ((r != 1 && r != NPTENTRIES) || !(bitmap[(1600 + 7) / 8] & (1 << ((1600 + 7) % 8))))
+		panic("2MB page harvested in two chunks isn't dirty");
+	if (harvest(SPLIT_VA, SPLIT_NPAGES) != 0)
+		panic("2MB page harvested in two chunks is still dirty");
+	cprintf("2MB dirty log ok\n");
+}
@@ -0,0 +1,52 @@
+// test copy-on-write fork: parent and child each keep their own copy
+// of data, bss and region pages they shared at fork time
+
+#include <inc/lib.h>
+
+#define REGION	((char *) 0x10000000)
+
+int data = 1;
+int bss[PGSIZE / sizeof(int)];
+
+static void
+check(const char *who, int d, int b, char r0, char r1)
+{
+	if (data != d || bss[0] != b || REGION[0] != r0 || REGION[PGSIZE] != r1)
+		panic("%s sees the wrong values", who);
+}
+
+void
+umain(int argc, char **argv)
+{
+	envid_t who;
+	int r;
+
+	if ((r = sys_region_reserve(REGION, 2 * PGSIZE, PTE_P | PTE_U | PTE_W)) < 0)
+		panic("sys_region_reserve: %e", r);
+	// The second region page is only read: the zero page, shared.
+	data = 2;
+	bss[0] = 2;
+	REGION[0] = 'p';
+	check("parent", 2, 2, 'p', 0);
+
+	if ((who = fork()) < 0)
+		panic("fork: %e", who);
+	if (who == 0) {
+		check("child before writing", 2, 2, 'p', 0);
+		data = 3;
+		bss[0] = 3;
+		REGION[0] = 'c';
+		REGION[PGSIZE] = 'c';
+		check("child after writing", 3, 3, 'c', 'c');
+		cprintf("child has its own copies\n");
+		ipc_send(thisenv->env_parent_id, 0, 0, 0);
+		return;
+	}
+
+	ipc_recv(0, 0, 0);
+	check("parent after the child wrote", 2, 2, 'p', 0);
+	data = 4;
+	REGION[PGSIZE] = 'q';
+	check("parent after writing", 4, 2, 'p', 'q');
+	cprintf("parent has its own copies\n");
+}
@@ -0,0 +1,33 @@
+// test 2MB user pages: a PTE_PS sys_page_alloc maps 2MB of zeroes, and
+// unmapping one page of it splits it without losing the rest
+
+#include <inc/lib.h>
+
+#define HUGE	((char *) 0x20000000)
+
+void
+umain(int argc, char **argv)
+{
+	int i, r;
+
+	// A 2MB page if one is free, else 512 pages: the same either way.
+	if ((r = sys_page_alloc(0, HUGE, PTE_P | PTE_U | PTE_W | PTE_PS)) < 0)
+		panic("sys_page_alloc 2MB: %e", r);
+	if ((r = sys_page_alloc(0, HUGE + PGSIZE, PTE_P | PTE_U | PTE_W | PTE_PS)) != -E_INVAL)
+		panic("unaligned 2MB sys_page_alloc: %e", r);
+	for (i = 0; i < NPTENTRIES; i++)
+		if (HUGE[i * PGSIZE] != 0 || HUGE[i * PGSIZE + PGSIZE - 1] != 0)
+			panic("2MB page isn't zero at page %d", i);
+	for (i = 0; i < NPTENTRIES; i++)
+		HUGE[i * PGSIZE] = i % 255 + 1;
+	cprintf("2MB page holds its values\n");
+
+	if ((r = sys_page_unmap(0, HUGE + PGSIZE)) < 0)
+		panic("sys_page_unmap: %e", r);
+	for (i = 0; i < NPTENTRIES; i++)
+		if (i != 1 && HUGE[i * PGSIZE] != i % 255 + 1)
+			panic("split 2MB page lost page %d", i);
+	cprintf("2MB page split; now touching the unmapped page...\n");
+	HUGE[PGSIZE] = 1;
+	panic("SHOULD HAVE TRAPPED!!!");
+}
@@ -0,0 +1,84 @@
+// test same-page merging: parent and child fill identical pages and a
+// page of zeroes, the grader runs "ksm scan" from the monitor while the
+// parent sits at a breakpoint, and writes after the merge stay private
+
+#include <inc/lib.h>
+
+#define PAGES	((char *) 0x10000000)
+#define NPAGES	4
+#define ZERO	(PAGES + NPAGES * PGSIZE)
+
+// Physical page number behind 'va'.
+static uint32_t
+ppn(char *va)
+{
+	return PGNUM(PTE_ADDR(uvpt[PGNUM(va)]));
+}
+
+static void
+fill(void)
+{
+	int i, r;
+
+	for (i = 0; i <= NPAGES; i++)
+		if ((r = sys_page_alloc(0, PAGES + i * PGSIZE, PTE_P | PTE_U | PTE_W)) < 0)
+			panic("sys_page_alloc: %e", r);
+	for (i = 0; i < NPAGES; i++)
+		memset(PAGES + i * PGSIZE, 'a' + i, PGSIZE);
+}
+
+static void
+check_merged(const char *who, int from)
+{
+	int i, j;
+
+	for (i = from; i <= NPAGES; i++) {
+		if ((uvpt[PGNUM(PAGES + i * PGSIZE)] & (PTE_KSM | PTE_W)) != PTE_KSM)
+			panic("%s: page %d isn't merged", who, i);
+		for (j = 0; j < PGSIZE; j++)
+			if (PAGES[i * PGSIZE + j] != (i < NPAGES ? 'a' + i : 0))
+				panic("%s: page %d changed in the merge", who, i);
+	}
+}
+
+void
+umain(int argc, char **argv)
+{
+	envid_t who;
+	uint32_t parent_ppn;
+
+	if ((who = fork()) < 0)
+		panic("fork: %e", who);
+	if (who == 0) {
+		fill();
+		ipc_send(thisenv->env_parent_id, 0, 0, 0);
+		parent_ppn = ipc_recv(0, 0, 0);
+		// The parent wrote to page 0 and the zero page since.
+		check_merged("child", 1);
+		if (ppn(PAGES + PGSIZE) != parent_ppn)
+			panic("child's page 1 isn't the parent's");
+		if (PAGES[0] != 'a' || ZERO[0] != 0)
+			panic("child sees the parent's writes");
+		cprintf("child's pages are shared and unchanged\n");
+		ipc_send(thisenv->env_parent_id, 0, 0, 0);
+		return;
+	}
+
+	ipc_recv(0, 0, 0);
+	fill();
+	cprintf("ksmmerge: pages filled\n");
+	asm volatile("int $3");
+
+	check_merged("parent", 0);
+	cprintf("pages merged\n");
+	PAGES[0] = 'x';
+	ZERO[0] = 'x';
+	if ((uvpt[PGNUM(PAGES)] & (PTE_KSM | PTE_W)) != PTE_W ||
+	    (uvpt[PGNUM(ZERO)] & (PTE_KSM | PTE_W)) != PTE_W)
+		panic("written pages are still merged");
+	if (PAGES[0] != 'x' || PAGES[1] != 'a' || ZERO[0] != 'x' || ZERO[1] != 0)
+		panic("written pages lost their contents");
+	cprintf("writes took private copies\n");
+	ipc_send(who, ppn(PAGES + PGSIZE), 0, 0);
+	ipc_recv(0, 0, 0);
+}
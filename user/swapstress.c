@@ -0,0 +1,34 @@
+// test swapping: fill more memory than the machine has, so that pages
+// go out to disk, then check every page as it comes back
+
+#include <inc/lib.h>
+
+#define REGION	((uint64_t *) 0x40000000)
+#define NPAGES	(72 * 1024 * 1024 / PGSIZE)
+#define WORDS	(PGSIZE / sizeof(uint64_t))
+
+void
+umain(int argc, char **argv)
+{
+	uint64_t i;
+	int r;
+
+	if ((r = sys_region_reserve(REGION, NPAGES * PGSIZE, PTE_P | PTE_U | PTE_W)) < 0)
+		panic("sys_region_reserve: %e", r);
+	for (i = 0; i < NPAGES; i++) {
+		REGION[i * WORDS] = i;
+		REGION[i * WORDS + WORDS - 1] = ~i;
+	}
+	cprintf("filled 72MB\n");
+	for (i = 0; i < NPAGES; i++)
+		if (REGION[i * WORDS] != i || REGION[i * WORDS + WORDS - 1] != ~i)
+			panic("page %lu came back wrong", i);
+	cprintf("read back 72MB\n");
+	// Once more, now that the first pages have been out and back.
+	for (i = 0; i < NPAGES; i++)
+		REGION[i * WORDS + 1] = i;
+	for (i = 0; i < NPAGES; i++)
+		if (REGION[i * WORDS] != i || REGION[i * WORDS + 1] != i)
+			panic("page %lu came back wrong the second time", i);
+	cprintf("swap round trips ok\n");
+}
@@ -0,0 +1,72 @@
+// test working-set estimates: touch a known number of pages, keep
+// touching only some of them, and check what envs[] reports for us
+
+#include <inc/lib.h>
+
+#define REGION	((char *) 0x10000000)
+#define HOT	64		// Touched before every scan
+#define COLD	64		// Touched once, after HOT
+#define NSCANS	6		// Scans with only HOT touched
+
+static const volatile struct Env *e;
+
+static void
+wait_scan(void)
+{
+	uint64_t scans = e->env_wss_scans;
+
+	while (e->env_wss_scans == scans)
+		sys_yield();
+}
+
+static void
+touch(int from, int n)
+{
+	int i;
+
+	for (i = from; i < from + n; i++)
+		REGION[i * PGSIZE]++;
+}
+
+void
+umain(int argc, char **argv)
+{
+	uint32_t rss0;
+	int i, r;
+
+	e = &envs[ENVX(sys_getenvid())];
+	wait_scan();
+	rss0 = e->env_rss;
+
+	for (i = 0; i < HOT + COLD; i++)
+		if ((r = sys_page_alloc(0, REGION + i * PGSIZE, PTE_P | PTE_U | PTE_W)) < 0)
+			panic("sys_page_alloc: %e", r);
+	// A scan may come in the middle of touch(), so wait for a second
+	// one and look at the window of 4 scans.
+	touch(0, HOT + COLD);
+	wait_scan();
+	wait_scan();
+	if (e->env_rss < rss0 + HOT + COLD)
+		panic("rss %lu doesn't count the %lu new pages",
+		      (uint64_t) e->env_rss, (uint64_t) (HOT + COLD));
+	if (e->env_wss[1] < HOT + COLD)
+		panic("working set %lu misses pages just touched",
+		      (uint64_t) e->env_wss[1]);
+	cprintf("working set holds the touched pages\n");
+
+	for (i = 0; i < NSCANS; i++) {
+		touch(0, HOT);
+		wait_scan();
+	}
+	// Cold pages were last touched NSCANS scans ago: outside the
+	// windows of 1 and 4 scans, inside the one of 16.
+	if (e->env_wss[0] > e->env_rss - COLD || e->env_wss[1] > e->env_rss - COLD)
+		panic("cold pages are still in the working set");
+	if (e->env_wss[1] < HOT)
+		panic("working set %lu misses the hot pages",
+		      (uint64_t) e->env_wss[1]);
+	if (e->env_wss[2] < HOT + COLD)
+		panic("16-scan working set %lu misses pages",
+		      (uint64_t) e->env_wss[2]);
+	cprintf("cold pages left the working set\n");
+}
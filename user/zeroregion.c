@@ -0,0 +1,42 @@
+// test zero-fill-on-demand regions: untouched pages read as zeroes,
+// writes stick, and a write to a read-only region faults
+
+#include <inc/lib.h>
+
+#define RW	((char *) 0x10000000)
+#define RO	((char *) 0x20000000)
+#define NPAGES	64
+
+void
+umain(int argc, char **argv)
+{
+	int i, r;
+
+	if ((r = sys_region_reserve(RW, NPAGES * PGSIZE, PTE_P | PTE_U | PTE_W)) < 0)
+		panic("sys_region_reserve: %e", r);
+	for (i = 0; i < NPAGES; i++)
+		if (RW[i * PGSIZE] != 0 || RW[i * PGSIZE + PGSIZE - 1] != 0)
+			panic("region page %d isn't zero", i);
+	cprintf("region reads zeroes\n");
+
+	// Every page was read above, so each starts out as the zero page.
+	// Odd pages are written at a different offset from even ones.
+	for (i = 0; i < NPAGES; i += 2)
+		RW[i * PGSIZE] = i + 1;
+	for (i = 1; i < NPAGES; i += 2)
+		RW[i * PGSIZE + 1] = i + 1;
+	for (i = 0; i < NPAGES; i++)
+		if (RW[i * PGSIZE + (i & 1)] != i + 1 || RW[i * PGSIZE + !(i & 1)] != 0)
+			panic("region page %d didn't hold its value", i);
+	cprintf("region writes stick\n");
+
+	if ((r = sys_region_reserve(RW, PGSIZE, PTE_P | PTE_U)) != -E_INVAL)
+		panic("overlapping sys_region_reserve: %e", r);
+	if ((r = sys_region_reserve(RO, PGSIZE, PTE_P | PTE_U)) < 0)
+		panic("sys_region_reserve: %e", r);
+	if (RO[0] != 0)
+		panic("read-only region isn't zero");
+	cprintf("read-only region reads zeroes; now writing to it...\n");
+	RO[0] = 1;
+	panic("SHOULD HAVE TRAPPED!!!");
+}